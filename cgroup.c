@@ -0,0 +1,326 @@
+/*
+ * CGROUP.C
+ *
+ * With -g, each job runs in a cgroup v2 group of its own, below the one
+ * crond was started in.  MEM=, CPU= and IO= tags set the group's
+ * memory.max, cpu.weight and io.weight; when the job ends its CPU time and
+ * peak memory are logged, and anything it left running is killed.  When
+ * there's no cgroup2 mount, or we can't make groups in it, jobs run as
+ * before.
+ *
+ * May be distributed under the GNU General Public License version 2 or any later version.
+ */
+
+#include "defs.h"
+
+Prototype void CgroupInit(void);
+Prototype int CgroupCreate(CronFile *file, CronLine *line);
+Prototype void CgroupEnd(CronFile *file, CronLine *line);
+Prototype int CgroupKill(CronLine *line);
+Prototype void CgroupReap(void);
+
+#define CG_MEMORY	0x01
+#define CG_CPU		0x02
+#define CG_IO		0x04
+
+typedef struct StaleGroup {
+	struct StaleGroup *sg_Next;
+	char	*sg_Path;
+} StaleGroup;
+
+int CgroupWrite(const char *dir, const char *name, const char *value);
+long long CgroupRead(const char *dir, const char *name, const char *key);
+char *CgroupFile(const char *dir, const char *name);
+
+char *CgroupDir = NULL;		/* where job groups are made, or NULL */
+int CgroupCtls = 0;			/* CG_* controllers enabled for job groups */
+unsigned long CgroupSeq = 0;
+StaleGroup *StaleGroups = NULL;	/* job groups that weren't empty yet when their job ended */
+
+/*
+ * CgroupInit() - find our cgroup v2 group, and get ready to make job groups in it
+ *
+ * A group with controllers enabled for its children can't hold processes
+ * itself (unless it's the root), so crond first moves into a "crond"
+ * child of its own.
+ */
+void
+CgroupInit(void)
+{
+	char buf[RW_BUFFER];
+	char mnt[RW_BUFFER];
+	char path[RW_BUFFER];
+	char *dir;
+	FILE *fi;
+
+	mnt[0] = path[0] = 0;
+	if ((fi = fopen("/proc/self/mountinfo", "r")) != NULL) {
+		while (fgets(buf, sizeof(buf), fi) != NULL) {
+			/* id parent major:minor root mountpoint options... - fstype source options */
+			char *sep = strstr(buf, " - cgroup2 ");
+			if (sep && sscanf(buf, "%*s %*s %*s %*s %1023s", mnt) == 1)
+				break;
+			mnt[0] = 0;
+		}
+		fclose(fi);
+	}
+	if ((fi = fopen("/proc/self/cgroup", "r")) != NULL) {
+		while (fgets(buf, sizeof(buf), fi) != NULL) {
+			if (strncmp(buf, "0::", 3) == 0 && sscanf(buf + 3, "%1023s", path) == 1)
+				break;
+			path[0] = 0;
+		}
+		fclose(fi);
+	}
+	if (mnt[0] == 0 || path[0] == 0) {
+		printlogf(LOG_NOTICE, "no cgroup2 hierarchy, running jobs without cgroups\n");
+		return;
+	}
+	if (!(dir = concat(mnt, strcmp(path, "/") ? path : "", NULL))) {
+		errno = ENOMEM;
+		perror("CgroupInit");
+		exit(1);
+	}
+
+	if (strcmp(path, "/") != 0) {
+		char *self = concat(dir, "/crond", NULL);
+		char pid[32];
+
+		snprintf(pid, sizeof(pid), "%d", (int)getpid());
+		if (!self) {
+			errno = ENOMEM;
+			perror("CgroupInit");
+			exit(1);
+		}
+		if ((mkdir(self, 0755) < 0 && errno != EEXIST) || CgroupWrite(self, "cgroup.procs", pid) < 0) {
+			printlogf(LOG_NOTICE, "unable to use cgroup %s (%s), running jobs without cgroups\n", dir, strerror(errno));
+			free(self);
+			free(dir);
+			return;
+		}
+		free(self);
+	}
+
+	if (CgroupWrite(dir, "cgroup.subtree_control", "+memory") == 0)
+		CgroupCtls |= CG_MEMORY;
+	if (CgroupWrite(dir, "cgroup.subtree_control", "+cpu") == 0)
+		CgroupCtls |= CG_CPU;
+	if (CgroupWrite(dir, "cgroup.subtree_control", "+io") == 0)
+		CgroupCtls |= CG_IO;
+	printlogf(LOG_NOTICE, "running jobs in cgroups under %s%s%s%s\n", dir,
+			(CgroupCtls & CG_MEMORY) ? "" : ", without MEM=",
+			(CgroupCtls & CG_CPU) ? "" : ", without CPU=",
+			(CgroupCtls & CG_IO) ? "" : ", without IO=");
+	CgroupDir = dir;
+}
+
+/*
+ * CgroupCreate() - make line's job group, and set its limits
+ *
+ * Returns a descriptor of the group's cgroup.procs for Launch(), or -1 if
+ * the job is to run without one.
+ */
+int
+CgroupCreate(CronFile *file, CronLine *line)
+{
+	char name[SMALL_BUFFER];
+	char value[32];
+	char *procs;
+	int fd;
+
+	if (!CgroupDir)
+		return(-1);
+	snprintf(name, sizeof(name), "/%s.%lu", file->cf_UserName, ++CgroupSeq);
+	if (!(line->cl_Cgroup = concat(CgroupDir, name, NULL))) {
+		errno = ENOMEM;
+		perror("CgroupCreate");
+		exit(1);
+	}
+	if (mkdir(line->cl_Cgroup, 0755) < 0) {
+		printlogf(LOG_WARNING, "unable to create cgroup %s: %s\n", line->cl_Cgroup, strerror(errno));
+		free(line->cl_Cgroup);
+		line->cl_Cgroup = NULL;
+		return(-1);
+	}
+
+	if (line->cl_MemMax && (CgroupCtls & CG_MEMORY)) {
+		snprintf(value, sizeof(value), "%lld", (long long)line->cl_MemMax);
+		if (CgroupWrite(line->cl_Cgroup, "memory.max", value) < 0)
+			printlogf(LOG_WARNING, "unable to set memory.max %s for user %s %s: %s\n", value, file->cf_UserName, line->cl_Description, strerror(errno));
+	}
+	if (line->cl_CpuWeight && (CgroupCtls & CG_CPU)) {
+		snprintf(value, sizeof(value), "%d", line->cl_CpuWeight);
+		if (CgroupWrite(line->cl_Cgroup, "cpu.weight", value) < 0)
+			printlogf(LOG_WARNING, "unable to set cpu.weight %s for user %s %s: %s\n", value, file->cf_UserName, line->cl_Description, strerror(errno));
+	}
+	if (line->cl_IoWeight && (CgroupCtls & CG_IO)) {
+		snprintf(value, sizeof(value), "%d", line->cl_IoWeight);
+		if (CgroupWrite(line->cl_Cgroup, "io.weight", value) < 0)
+			printlogf(LOG_WARNING, "unable to set io.weight %s for user %s %s: %s\n", value, file->cf_UserName, line->cl_Description, strerror(errno));
+	}
+
+	procs = CgroupFile(line->cl_Cgroup, "cgroup.procs");
+	fd = open(procs, O_WRONLY|O_CLOEXEC);
+	free(procs);
+	if (fd < 0) {
+		printlogf(LOG_WARNING, "unable to use cgroup %s: %s\n", line->cl_Cgroup, strerror(errno));
+		rmdir(line->cl_Cgroup);
+		free(line->cl_Cgroup);
+		line->cl_Cgroup = NULL;
+	}
+	return(fd);
+}
+
+/*
+ * CgroupEnd() - line's job has exited: log what its group used, kill
+ * anything still in it, and remove it
+ */
+void
+CgroupEnd(CronFile *file, CronLine *line)
+{
+	long long usage, user, sys, peak;
+	StaleGroup *sg;
+
+	if (!line->cl_Cgroup)
+		return;
+
+	usage = CgroupRead(line->cl_Cgroup, "cpu.stat", "usage_usec");
+	user = CgroupRead(line->cl_Cgroup, "cpu.stat", "user_usec");
+	sys = CgroupRead(line->cl_Cgroup, "cpu.stat", "system_usec");
+	peak = CgroupRead(line->cl_Cgroup, "memory.peak", NULL);
+	if (usage > 0) {
+		if (peak >= 0)
+			printlogf(LOG_INFO, "cpu %lld.%03llds (user %lld.%03llds sys %lld.%03llds), peak memory %lld kB: user %s %s\n",
+					usage / 1000000, usage / 1000 % 1000, user / 1000000, user / 1000 % 1000,
+					sys / 1000000, sys / 1000 % 1000, peak / 1024,
+					file->cf_UserName, line->cl_Description);
+		else
+			printlogf(LOG_INFO, "cpu %lld.%03llds (user %lld.%03llds sys %lld.%03llds): user %s %s\n",
+					usage / 1000000, usage / 1000 % 1000, user / 1000000, user / 1000 % 1000,
+					sys / 1000000, sys / 1000 % 1000,
+					file->cf_UserName, line->cl_Description);
+	}
+
+	if (CgroupRead(line->cl_Cgroup, "cgroup.events", "populated") > 0) {
+		printlogf(LOG_NOTICE, "killing processes left behind by user %s %s\n", file->cf_UserName, line->cl_Description);
+		CgroupKill(line);
+	}
+
+	if (rmdir(line->cl_Cgroup) < 0) {
+		/* the killed processes haven't all gone yet; CgroupReap tries again */
+		if (!(sg = malloc(sizeof(StaleGroup)))) {
+			errno = ENOMEM;
+			perror("CgroupEnd");
+			exit(1);
+		}
+		sg->sg_Path = line->cl_Cgroup;
+		sg->sg_Next = StaleGroups;
+		StaleGroups = sg;
+	} else
+		free(line->cl_Cgroup);
+	line->cl_Cgroup = NULL;
+}
+
+/*
+ * CgroupKill() - SIGKILL everything in line's job group
+ *
+ * Returns 0, or -1 if the job has no group.
+ */
+int
+CgroupKill(CronLine *line)
+{
+	char *procs;
+	FILE *fi;
+	int pid;
+
+	if (!line->cl_Cgroup)
+		return(-1);
+	/* cgroup.kill is new in Linux 5.14; before that, kill what's listed */
+	if (CgroupWrite(line->cl_Cgroup, "cgroup.kill", "1") == 0)
+		return(0);
+	procs = CgroupFile(line->cl_Cgroup, "cgroup.procs");
+	if ((fi = fopen(procs, "r")) != NULL) {
+		while (fscanf(fi, "%d", &pid) == 1)
+			kill(pid, SIGKILL);
+		fclose(fi);
+	}
+	free(procs);
+	return(0);
+}
+
+/*
+ * CgroupReap() - remove the job groups that have emptied since their job ended
+ */
+void
+CgroupReap(void)
+{
+	StaleGroup **psg = &StaleGroups;
+	StaleGroup *sg;
+
+	while ((sg = *psg) != NULL) {
+		if (rmdir(sg->sg_Path) == 0 || errno == ENOENT) {
+			*psg = sg->sg_Next;
+			free(sg->sg_Path);
+			free(sg);
+		} else
+			psg = &sg->sg_Next;
+	}
+}
+
+char *
+CgroupFile(const char *dir, const char *name)
+{
+	char *path;
+
+	if (!(path = concat(dir, "/", name, NULL))) {
+		errno = ENOMEM;
+		perror("CgroupFile");
+		exit(1);
+	}
+	return(path);
+}
+
+int
+CgroupWrite(const char *dir, const char *name, const char *value)
+{
+	char *path = CgroupFile(dir, name);
+	int fd;
+	int r = -1;
+
+	if ((fd = open(path, O_WRONLY|O_CLOEXEC)) >= 0) {
+		if (write(fd, value, strlen(value)) == strlen(value))
+			r = 0;
+		close(fd);
+	}
+	free(path);
+	return(r);
+}
+
+/*
+ * CgroupRead() - the number in a cgroup file, or after key in a "key value"
+ * file; -1 if there's no such file or key
+ */
+long long
+CgroupRead(const char *dir, const char *name, const char *key)
+{
+	char *path = CgroupFile(dir, name);
+	char buf[SMALL_BUFFER];
+	long long val = -1;
+	FILE *fi;
+
+	if ((fi = fopen(path, "r")) != NULL) {
+		while (fgets(buf, sizeof(buf), fi) != NULL) {
+			if (!key) {
+				val = strtoll(buf, NULL, 10);
+				break;
+			}
+			if (strncmp(buf, key, strlen(key)) == 0 && buf[strlen(key)] == ' ') {
+				val = strtoll(buf + strlen(key) + 1, NULL, 10);
+				break;
+			}
+		}
+		fclose(fi);
+	}
+	free(path);
+	return(val);
+}
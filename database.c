@@ -9,32 +9,93 @@
 
 #include "defs.h"
 
-#define FIRST_DOW  (1 << 0)
-#define SECOND_DOW (1 << 1)
-#define THIRD_DOW  (1 << 2)
-#define FOURTH_DOW (1 << 3)
-#define FIFTH_DOW  (1 << 4)
-#define LAST_DOW   (1 << 5)
-#define ALL_DOW    (FIRST_DOW|SECOND_DOW|THIRD_DOW|FOURTH_DOW|FIFTH_DOW|LAST_DOW)
-
-Prototype void CheckUpdates(const char *dpath, const char *user_override, time_t t1, time_t t2);
+Prototype void CheckUpdates(const char *dpath, const char *user_override, time_t t1, time_t t2, short watched);
 Prototype void SynchronizeDir(const char *dpath, const char *user_override, int initial_scan);
 Prototype void ReadTimestamps(const char *user);
+Prototype void ReadTimestamp(CronFile *file, CronLine *line);
+Prototype void WriteTimestamp(CronFile *file, CronLine *line, int exit_status);
+Prototype void SyncTimestamps(void);
+Prototype void CheckTimestamp(CronLine *line);
+Prototype void KnowStamp(const char *path, time_t lastRan, time_t notUntil, struct stat *sbuf);
+Prototype void LinkFile(CronFile *file);
+Prototype HashTable KnownStamps;
+Prototype short SnapshotDirty;
+Prototype void SynchronizeFile(const char *dpath, const char *fname, const char *uname);
 Prototype int TestJobs(time_t t1, time_t t2);
 Prototype int TestStartupJobs(void);
 Prototype int ArmJob(CronFile *file, CronLine *line, time_t t1, time_t t2);
 Prototype void RunJobs(void);
 Prototype int CheckJobs(void);
-
-void SynchronizeFile(const char *dpath, const char *fname, const char *uname);
-void DeleteFile(CronFile **pfile);
-char *ParseInterval(int *interval, char *ptr);
-char *ParseField(char *userName, char *ary, int modvalue, int offset, int onvalue, const char **names, char *ptr);
-void FixDayDow(CronLine *line);
+Prototype void ReapJobs(void);
+Prototype time_t CheckTimeouts(time_t t);
+Prototype short WaitersChanged;
+Prototype int JobsQueued;
+Prototype CronFile *FileBase;
+Prototype CronFile *FindUserFile(const char *user, CronFile *prev);
+Prototype CronFile *FindFile(const char *dpath, const char *fname);
+Prototype CronLine *FindJob(CronFile *file, const char *name);
+Prototype char *ParseInterval(int *interval, char *ptr);
+
+void DeleteFile(CronFile *file);
+void ResolveWaiters(CronFile *file);
+void BreakCycles(CronFile *file);
+void DropWaiter(CronWaiter **pwaiter);
+void QueueJob(CronLine *line, time_t t);
+void StopJob(CronLine *line, time_t t);
+void UnqueueJob(CronLine *line);
+int CountUserJobs(const char *user, int delta);
+KnownStamp *FindKnownStamp(const char *path);
+void ApplyStamp(CronLine *line, time_t lastRan, time_t notUntil);
+unsigned long PathHash(const char *dpath, const char *fname);
+int SameStat(CronFile *file, struct stat *sbuf);
+char *ParseSize(int64_t *size, char *ptr);
+char *ParseField(char *userName, uint64_t *mask, int modvalue, int offset, const char **names, char *ptr);
+void FixDayDow(CronLine *line, uint64_t dow);
 void PrintLine(CronLine *line);
 void PrintFile(CronFile *file, char* loc, char* fname, int line);
 
 CronFile *FileBase = NULL;
+HashTable FilesByUser;		/* live CronFiles, by cf_UserName */
+HashTable FilesByPath;		/* live CronFiles, by cf_DPath and cf_FileName */
+short WaitersChanged = 0;	/* set when a notifier finishes, so waiting jobs are rechecked */
+HashTable RunningJobs;		/* running CronLines, by cl_Pid */
+HashTable UserLoads;		/* users with running jobs, by ul_Name */
+CronLine *JobQueue = NULL;	/* armed jobs waiting for a free slot, oldest first */
+CronLine **JobQueueTail = &JobQueue;
+int JobsQueued = 0;
+
+typedef struct UserLoad {
+	char	*ul_Name;
+	int		ul_Running;
+} UserLoad;
+
+typedef struct PendingStamp {
+	struct PendingStamp *ps_Next;
+	char	*ps_Path;		/* a stamp whose new contents are in ps_Path.new */
+} PendingStamp;
+
+PendingStamp *PendingStamps = NULL;	/* written, not yet synced and renamed into place */
+
+HashTable KnownStamps;		/* every stamp we've read or written, by ks_Path */
+short SnapshotDirty = 0;	/* crontabs were parsed or dropped since the last snapshot */
+
+typedef struct ParseTask {
+	char	*pt_FileName;
+	const char *pt_UserName;
+	CronFile *pt_File;		/* as parsed, or NULL */
+} ParseTask;
+
+typedef struct ParsePool {
+	const char *pp_DPath;
+	ParseTask *pp_Tasks;
+	int		pp_Count;
+	int		pp_Next;		/* the next task a worker takes */
+	pthread_mutex_t pp_Lock;
+} ParsePool;
+
+CronFile *ParseFile(const char *dpath, const char *fileName, const char *userName);
+void ParseFiles(const char *dpath, ParseTask *tasks, int count);
+void *ParseWorker(void *arg);
 
 const char *DowAry[] = {
 	"sun",
@@ -99,9 +160,12 @@ const char *FreqAry[] = {
  * Check the cron.update file in the specified directory.  If user_override
  * is NULL then the files in the directory belong to the user whose name is
  * the file, otherwise they belong to the user_override user.
+ *
+ * If the directory is watched, a crontab named here was already re-read when
+ * inotify saw it written, so only the lines prodding jobs are acted on.
  */
 void
-CheckUpdates(const char *dpath, const char *user_override, time_t t1, time_t t2)
+CheckUpdates(const char *dpath, const char *user_override, time_t t1, time_t t2, short watched)
 {
 	FILE *fi;
 	char buf[SMALL_BUFFER];
@@ -125,6 +189,8 @@ CheckUpdates(const char *dpath, const char *user_override, time_t t1, time_t t2)
 			 */
 			fname = strtok_r(buf, " \t\n", &ptok);
 
+			if (!fname || (watched && (*ptok == 0 || *ptok == '\n')))
+				continue;
 			if (user_override)
 				SynchronizeFile(dpath, fname, user_override);
 			else if (!getpwnam(fname))
@@ -134,12 +200,7 @@ CheckUpdates(const char *dpath, const char *user_override, time_t t1, time_t t2)
 				ReadTimestamps(fname);
 			} else {
 				/* if fname is followed by whitespace, we prod any following jobs */
-				CronFile *file = FileBase;
-				while (file) {
-					if (strcmp(file->cf_UserName, fname) == 0)
-						break;
-					file = file->cf_Next;
-				}
+				CronFile *file = FindUserFile(fname, NULL);
 				if (!file)
 					printlogf(LOG_WARNING, "unable to prod for user %s: no crontab\n", fname);
 				else {
@@ -152,13 +213,7 @@ CheckUpdates(const char *dpath, const char *user_override, time_t t1, time_t t2)
 							force = (time_t)-1;
 							++job;
 						}
-						line = file->cf_LineBase;
-						while (line) {
-							if (line->cl_JobName && strcmp(line->cl_JobName, job) == 0)
-								break;
-							line = line->cl_Next;
-						}
-						if (line)
+						if ((line = FindJob(file, job)) != NULL)
 							ArmJob(file, line, t1, force);
 						else {
 							printlogf(LOG_WARNING, "unable to prod for user %s: unknown job %s\n", fname, job);
@@ -176,29 +231,19 @@ CheckUpdates(const char *dpath, const char *user_override, time_t t1, time_t t2)
 void
 SynchronizeDir(const char *dpath, const char *user_override, int initial_scan)
 {
-	CronFile **pfile;
 	CronFile *file;
+	CronFile *next;
 	struct dirent *den;
+	struct stat sbuf;
 	DIR *dir;
 	char *path;
+	ParseTask *tasks = NULL;
+	int count = 0;
+	int n;
 
 	if (DebugOpt)
 		printlogf(LOG_DEBUG, "Synchronizing %s\n", dpath);
 
-	/*
-	 * Delete all database CronFiles for this directory.  DeleteFile() will
-	 * free *pfile and relink the *pfile pointer, or in the alternative will
-	 * mark it as deleted.
-	 */
-	pfile = &FileBase;
-	while ((file = *pfile) != NULL) {
-		if (file->cf_Deleted == 0 && strcmp(file->cf_DPath, dpath) == 0) {
-			DeleteFile(pfile);
-		} else {
-			pfile = &file->cf_Next;
-		}
-	}
-
 	/*
 	 * Since we are resynchronizing the entire directory, remove the
 	 * the CRONUPDATE file.
@@ -211,30 +256,165 @@ SynchronizeDir(const char *dpath, const char *user_override, int initial_scan)
 	remove(path);
 	free(path);
 
+	for (file = FileBase; file; file = file->cf_Next)
+		file->cf_Seen = 0;
+
 	/*
-	 * Scan the specified directory
+	 * Scan the specified directory.  Files we already have, and which
+	 * haven't changed since we parsed them, are left alone.  The rest are
+	 * parsed together, in parallel, once we know what they are.
 	 */
 	if ((dir = opendir(dpath)) != NULL) {
 		while ((den = readdir(dir)) != NULL) {
+			const char *user = NULL;
+
 			if (strchr(den->d_name, '.') != NULL)
 				continue;
 			if (strcmp(den->d_name, CRONUPDATE) == 0)
 				continue;
-			if (user_override) {
-				SynchronizeFile(dpath, den->d_name, user_override);
+			if (!(path = concat(dpath, "/", den->d_name, NULL))) {
+				errno = ENOMEM;
+				perror("SynchronizeDir");
+				exit(1);
+			}
+			if (stat(path, &sbuf) == 0 && (file = FindFile(dpath, den->d_name)) != NULL &&
+					SameStat(file, &sbuf)
+			   ) {
+				file->cf_Seen = 1;
+			} else if (user_override) {
+				user = user_override;
 			} else if (getpwnam(den->d_name)) {
-				SynchronizeFile(dpath, den->d_name, den->d_name);
+				user = den->d_name;
 			} else {
 				printlogf(LOG_WARNING, "ignoring %s/%s (non-existent user)\n",
 						dpath, den->d_name);
 			}
+			free(path);
+			if (user) {
+				if ((count & (count - 1)) == 0 &&
+						!(tasks = realloc(tasks, (count ? count * 2 : 1) * sizeof(ParseTask)))) {
+					errno = ENOMEM;
+					perror("SynchronizeDir");
+					exit(1);
+				}
+				if (!(tasks[count].pt_FileName = strdup(den->d_name))) {
+					errno = ENOMEM;
+					perror("SynchronizeDir");
+					exit(1);
+				}
+				/* user is den->d_name, which the next readdir may reuse */
+				tasks[count].pt_UserName = user_override ? user_override : tasks[count].pt_FileName;
+				tasks[count].pt_File = NULL;
+				++count;
+			}
 		}
 		closedir(dir);
+
+		/*
+		 * Link what was parsed in, in the order we found it, replacing
+		 * any older copy.  A file that couldn't be read just goes.
+		 */
+		ParseFiles(dpath, tasks, count);
+		for (n = 0; n < count; ++n) {
+			if ((file = FindFile(dpath, tasks[n].pt_FileName)) != NULL)
+				DeleteFile(file);
+			if (tasks[n].pt_File)
+				LinkFile(tasks[n].pt_File);
+			free(tasks[n].pt_FileName);
+		}
+		free(tasks);
 	} else {
 		if (initial_scan)
 			printlogf(LOG_ERR, "unable to scan directory %s\n", dpath);
 			/* softerror, do not exit the program */
 	}
+
+	/*
+	 * Delete the database CronFiles for this directory that weren't seen
+	 * above, nor just (re)parsed.  DeleteFile() will free the file, or in
+	 * the alternative will mark it as deleted.
+	 */
+	for (file = FileBase; file; file = next) {
+		next = file->cf_Next;
+		if (file->cf_Deleted == 0 && file->cf_Seen == 0 && strcmp(file->cf_DPath, dpath) == 0)
+			DeleteFile(file);
+	}
+}
+
+/*
+ * FindFile() - the live CronFile parsed from dpath/fname, if any
+ */
+CronFile *
+FindFile(const char *dpath, const char *fname)
+{
+	CronFile *file;
+	HashNode *hn;
+
+	for (hn = HashFirst(&FilesByPath, PathHash(dpath, fname)); hn; hn = HashNext(hn)) {
+		file = hn->hn_Data;
+		if (strcmp(file->cf_DPath, dpath) == 0 && strcmp(file->cf_FileName, fname) == 0)
+			return(file);
+	}
+	return(NULL);
+}
+
+/*
+ * FindUserFile() - the first live CronFile run as user, or the next after prev
+ */
+CronFile *
+FindUserFile(const char *user, CronFile *prev)
+{
+	CronFile *file;
+	HashNode *hn;
+
+	if (prev)
+		hn = HashNext(prev->cf_UserNode);
+	else
+		hn = HashFirst(&FilesByUser, HashString(HASH_INIT, user));
+	for (; hn; hn = HashNext(hn)) {
+		file = hn->hn_Data;
+		if (strcmp(file->cf_UserName, user) == 0)
+			return(file);
+	}
+	return(NULL);
+}
+
+/*
+ * FindJob() - the job named name in file
+ */
+CronLine *
+FindJob(CronFile *file, const char *name)
+{
+	CronLine *line;
+	HashNode *hn;
+
+	for (hn = HashFirst(&file->cf_Jobs, HashString(HASH_INIT, name)); hn; hn = HashNext(hn)) {
+		line = hn->hn_Data;
+		if (strcmp(line->cl_JobName, name) == 0)
+			return(line);
+	}
+	return(NULL);
+}
+
+unsigned long
+PathHash(const char *dpath, const char *fname)
+{
+	return(HashString(HashString(HASH_INIT, dpath), fname));
+}
+
+/*
+ * SameStat() - is sbuf the file we parsed into file?
+ */
+int
+SameStat(CronFile *file, struct stat *sbuf)
+{
+	return (file->cf_Dev == sbuf->st_dev &&
+			file->cf_Ino == sbuf->st_ino &&
+			file->cf_Size == sbuf->st_size &&
+			file->cf_Mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+			file->cf_Mtime.tv_nsec == sbuf->st_mtim.tv_nsec &&
+			file->cf_Ctime.tv_sec == sbuf->st_ctim.tv_sec &&
+			file->cf_Ctime.tv_nsec == sbuf->st_ctim.tv_nsec);
 }
 
 
@@ -243,77 +423,380 @@ ReadTimestamps(const char *user)
 {
 	CronFile *file;
 	CronLine *line;
-	FILE *fi;
-	char buf[SMALL_BUFFER];
-	char *ptr;
-	struct tm tm = {0};
-	time_t sec, freq;
 
-	file = FileBase;
+	file = user ? FindUserFile(user, NULL) : FileBase;
 	while (file != NULL) {
-		if (file->cf_Deleted == 0 && (!user || strcmp(user, file->cf_UserName) == 0)) {
+		if (file->cf_Deleted == 0) {
 			line = file->cf_LineBase;
 			while (line != NULL) {
-				if (line->cl_Timestamp) {
-					if ((fi = fopen(line->cl_Timestamp, "r")) != NULL) {
-						if (fgets(buf, sizeof(buf), fi) != NULL) {
-							int fake = 0;
-							ptr = buf;
-							if (strncmp(buf, "after ", 6) == 0) {
-								fake = 1;
-								ptr += 6;
-							}
-							sec = (time_t)-1;
-							ptr = strptime(ptr, CRONSTAMP_FMT, &tm);
-							if (ptr && (*ptr == 0 || *ptr == '\n')) {
-								/* strptime uses current seconds when seconds not specified? anyway, we don't get round minutes */
-								tm.tm_sec = 0;
-								tm.tm_isdst = -1;
-								sec = mktime(&tm);
-							}
-							if (sec == (time_t)-1) {
-								printlogf(LOG_ERR, "unable to parse timestamp (user %s job %s)\n", file->cf_UserName, line->cl_JobName);
-								/* we continue checking other timestamps in this CronFile */
-							} else {
-								/* sec -= sec % 60; */
-								if (fake) {
-									line->cl_NotUntil = sec;
-								} else {
-									line->cl_LastRan = sec;
-									freq = (line->cl_Freq > 0) ? line->cl_Freq : line->cl_Delay;
-									/* if (line->cl_NotUntil < line->cl_LastRan + freq) */
-									line->cl_NotUntil = line->cl_LastRan + freq;
-								}
-							}
-						}
-						fclose(fi);
-					} else {
-						int succeeded = 0;
-						printlogf(LOG_NOTICE, "no timestamp found (user %s job %s)\n", file->cf_UserName, line->cl_JobName);
-						/* write a fake timestamp file so our initial NotUntil doesn't keep being reset every hour when crond does a SynchronizeDir */
-						if ((fi = fopen(line->cl_Timestamp, "w")) != NULL) {
-							if (strftime(buf, sizeof(buf), CRONSTAMP_FMT, localtime(&line->cl_NotUntil)))
-								if (fputs("after ", fi) >= 0)
-									if (fputs(buf,fi) >= 0)
-										succeeded = 1;
-							fclose(fi);
-						}
-						if (!succeeded)
-							printlogf(LOG_WARNING, "unable to write timestamp to %s (user %s %s)\n", line->cl_Timestamp, file->cf_UserName, line->cl_Description);
-					}
-				}
+				if (line->cl_Timestamp)
+					ReadTimestamp(file, line);
 				line = line->cl_Next;
 			}
 		}
-		file = file->cf_Next;
+		file = user ? FindUserFile(user, file) : file->cf_Next;
+	}
+}
+
+/*
+ * ReadTimestamp() - load one job's timestamp, writing a fake one if it has none
+ *
+ * A stamp we've read or written before is taken from memory, so reparsing
+ * a crontab or a resync costs no stamp files.  Without inotify to tell us
+ * when someone else writes a text stamp, CheckTimestamp() stats it first.
+ *
+ * A text stamp wins over one in the -k store: it's from before -k, or was
+ * written since by someone else.  Either way it moves into the store.
+ */
+void
+ReadTimestamp(CronFile *file, CronLine *line)
+{
+	FILE *fi;
+	char buf[SMALL_BUFFER];
+	char *ptr;
+	struct tm tm = {0};
+	time_t sec, notUntil;
+	struct stat sbuf;
+	PendingStamp *ps;
+	KnownStamp *ks;
+
+	/* the file may be behind what we've written */
+	for (ps = PendingStamps; ps; ps = ps->ps_Next) {
+		if (strcmp(ps->ps_Path, line->cl_Timestamp) == 0) {
+			SyncTimestamps();
+			break;
+		}
+	}
+	if (TSDirWd < 0)
+		CheckTimestamp(line);
+	if ((ks = FindKnownStamp(line->cl_Timestamp)) != NULL) {
+		ApplyStamp(line, ks->ks_LastRan, ks->ks_NotUntil);
+		return;
+	}
+
+	if ((fi = fopen(line->cl_Timestamp, "r")) != NULL) {
+		if (fgets(buf, sizeof(buf), fi) != NULL) {
+			int fake = 0;
+			ptr = buf;
+			if (strncmp(buf, "after ", 6) == 0) {
+				fake = 1;
+				ptr += 6;
+			}
+			sec = (time_t)-1;
+			ptr = strptime(ptr, CRONSTAMP_FMT, &tm);
+			if (ptr && (*ptr == 0 || *ptr == '\n')) {
+				/* strptime uses current seconds when seconds not specified? anyway, we don't get round minutes */
+				tm.tm_sec = 0;
+				tm.tm_isdst = -1;
+				sec = mktime(&tm);
+			}
+			if (sec == (time_t)-1) {
+				printlogf(LOG_ERR, "unable to parse timestamp (user %s job %s)\n", file->cf_UserName, line->cl_JobName);
+				/* we continue checking other timestamps in this CronFile */
+			} else {
+				/* sec -= sec % 60; */
+				ApplyStamp(line, fake ? 0 : sec, sec);
+				if (StampPut(file->cf_UserName, line->cl_JobName, fake ? 0 : sec, line->cl_NotUntil, 0) == 0) {
+					remove(line->cl_Timestamp);
+					KnowStamp(line->cl_Timestamp, fake ? 0 : sec, sec, NULL);
+				} else if (fstat(fileno(fi), &sbuf) == 0)
+					KnowStamp(line->cl_Timestamp, fake ? 0 : sec, sec, &sbuf);
+			}
+		}
+		fclose(fi);
+	} else if (StampGet(file->cf_UserName, line->cl_JobName, &sec, &notUntil)) {
+		ApplyStamp(line, sec, notUntil);
+		KnowStamp(line->cl_Timestamp, sec, notUntil, NULL);
+	} else {
+		printlogf(LOG_NOTICE, "no timestamp found (user %s job %s)\n", file->cf_UserName, line->cl_JobName);
+		/* write a fake timestamp so our initial NotUntil doesn't keep being reset every hour when crond does a SynchronizeDir */
+		WriteTimestamp(file, line, -1);
+	}
+}
+
+/*
+ * ApplyStamp() - set line's times from its stamp, and reschedule it
+ */
+void
+ApplyStamp(CronLine *line, time_t lastRan, time_t notUntil)
+{
+	if (lastRan) {
+		line->cl_LastRan = lastRan;
+		/* if (line->cl_NotUntil < line->cl_LastRan + freq) */
+		line->cl_NotUntil = line->cl_LastRan + ((line->cl_Freq > 0) ? line->cl_Freq : line->cl_Delay);
+	} else
+		line->cl_NotUntil = notUntil;
+	ScheduleLine(line, SchedTime);
+}
+
+/*
+ * CheckTimestamp() - forget what we know of line's stamp if its text file
+ * isn't the one we last read or wrote
+ */
+void
+CheckTimestamp(CronLine *line)
+{
+	KnownStamp *ks;
+	struct stat sbuf;
+
+	if (!(ks = FindKnownStamp(line->cl_Timestamp)))
+		return;
+	if (stat(line->cl_Timestamp, &sbuf) < 0) {
+		/* gone, or never there; what we know still holds */
+		return;
+	}
+	if (sbuf.st_ino == ks->ks_Ino && sbuf.st_size == ks->ks_Size &&
+			sbuf.st_mtim.tv_sec == ks->ks_Mtime.tv_sec &&
+			sbuf.st_mtim.tv_nsec == ks->ks_Mtime.tv_nsec)
+		return;
+	if (DebugOpt)
+		printlogf(LOG_DEBUG, "timestamp %s changed\n", line->cl_Timestamp);
+	HashDel(&KnownStamps, ks->ks_Node);
+	free(ks->ks_Path);
+	free(ks);
+}
+
+KnownStamp *
+FindKnownStamp(const char *path)
+{
+	HashNode *hn;
+
+	for (hn = HashFirst(&KnownStamps, HashString(HASH_INIT, path)); hn; hn = HashNext(hn)) {
+		if (strcmp(((KnownStamp *)hn->hn_Data)->ks_Path, path) == 0)
+			return(hn->hn_Data);
+	}
+	return(NULL);
+}
+
+/*
+ * KnowStamp() - remember the stamp at path, and its text file's sbuf, if any
+ */
+void
+KnowStamp(const char *path, time_t lastRan, time_t notUntil, struct stat *sbuf)
+{
+	KnownStamp *ks;
+
+	if (!(ks = FindKnownStamp(path))) {
+		if (!(ks = malloc(sizeof(KnownStamp))) || !(ks->ks_Path = strdup(path))) {
+			errno = ENOMEM;
+			perror("KnowStamp");
+			exit(1);
+		}
+		ks->ks_Node = HashAdd(&KnownStamps, HashString(HASH_INIT, ks->ks_Path), ks);
+	}
+	ks->ks_LastRan = lastRan;
+	ks->ks_NotUntil = notUntil;
+	if (sbuf) {
+		ks->ks_Ino = sbuf->st_ino;
+		ks->ks_Size = sbuf->st_size;
+		ks->ks_Mtime = sbuf->st_mtim;
+	} else {
+		ks->ks_Ino = 0;
+		ks->ks_Size = 0;
+		ks->ks_Mtime.tv_sec = ks->ks_Mtime.tv_nsec = 0;
+	}
+}
+
+/*
+ * WriteTimestamp() - save that line's job last ran at cl_LastRan, exiting
+ * with exit_status; or, for exit_status -1, that it's not to run before
+ * cl_NotUntil
+ *
+ * A text stamp is written beside the old one, which stays until
+ * SyncTimestamps() renames the new one over it.
+ */
+void
+WriteTimestamp(CronFile *file, CronLine *line, int exit_status)
+{
+	FILE *fi;
+	char buf[SMALL_BUFFER];
+	char *tmp;
+	int succeeded = 0;
+	int fake = (exit_status < 0);
+	PendingStamp *ps;
+
+	/* its text file, if it gets one, is known once it's renamed into place */
+	KnowStamp(line->cl_Timestamp, fake ? 0 : line->cl_LastRan, line->cl_NotUntil, NULL);
+	if (StampPut(file->cf_UserName, line->cl_JobName, fake ? 0 : line->cl_LastRan, line->cl_NotUntil, exit_status) == 0)
+		return;
+	if (!(tmp = concat(line->cl_Timestamp, ".new", NULL))) {
+		errno = ENOMEM;
+		perror("WriteTimestamp");
+		exit(1);
+	}
+	if ((fi = fopen(tmp, "w")) != NULL) {
+		if (strftime(buf, sizeof(buf), CRONSTAMP_FMT, localtime(fake ? &line->cl_NotUntil : &line->cl_LastRan)))
+			if (!fake || fputs("after ", fi) >= 0)
+				if (fputs(buf, fi) >= 0)
+					succeeded = 1;
+		if (fclose(fi) != 0)
+			succeeded = 0;
+	}
+	if (!succeeded) {
+		printlogf(LOG_WARNING, "unable to write timestamp to %s (user %s %s)\n", line->cl_Timestamp, file->cf_UserName, line->cl_Description);
+		remove(tmp);
+		free(tmp);
+		return;
+	}
+	free(tmp);
+
+	for (ps = PendingStamps; ps; ps = ps->ps_Next) {
+		if (strcmp(ps->ps_Path, line->cl_Timestamp) == 0)
+			return;
+	}
+	if (!(ps = malloc(sizeof(PendingStamp))) || !(ps->ps_Path = strdup(line->cl_Timestamp))) {
+		errno = ENOMEM;
+		perror("WriteTimestamp");
+		exit(1);
+	}
+	ps->ps_Next = PendingStamps;
+	PendingStamps = ps;
+}
+
+/*
+ * SyncTimestamps() - make the stamps written since we last looked durable
+ *
+ * Called once per wakeup, so jobs that finish together share the cost:
+ * each new text stamp is fdatasync()ed, then they're all renamed over the
+ * old ones, and one fsync() of TSDir makes the renames stick.  A crash at
+ * any point leaves each stamp whole, old or new.  The -k store is
+ * msync()ed.
+ */
+void
+SyncTimestamps(void)
+{
+	PendingStamp *ps;
+	KnownStamp *ks;
+	struct stat sbuf;
+	char *tmp;
+	int fd;
+
+	StampSync();
+	if (!PendingStamps)
+		return;
+
+	for (ps = PendingStamps; ps; ps = ps->ps_Next) {
+		if (!(tmp = concat(ps->ps_Path, ".new", NULL))) {
+			errno = ENOMEM;
+			perror("SyncTimestamps");
+			exit(1);
+		}
+		if ((fd = open(tmp, O_WRONLY|O_CLOEXEC)) >= 0) {
+			fdatasync(fd);
+			close(fd);
+		}
+		free(tmp);
+	}
+	while ((ps = PendingStamps) != NULL) {
+		PendingStamps = ps->ps_Next;
+		if (!(tmp = concat(ps->ps_Path, ".new", NULL))) {
+			errno = ENOMEM;
+			perror("SyncTimestamps");
+			exit(1);
+		}
+		if (rename(tmp, ps->ps_Path) < 0)
+			printlogf(LOG_WARNING, "unable to write timestamp to %s: %s\n", ps->ps_Path, strerror(errno));
+		else if ((ks = FindKnownStamp(ps->ps_Path)) != NULL && stat(ps->ps_Path, &sbuf) == 0) {
+			/* so CheckTimestamp knows it for ours */
+			ks->ks_Ino = sbuf.st_ino;
+			ks->ks_Size = sbuf.st_size;
+			ks->ks_Mtime = sbuf.st_mtim;
+		}
+		free(tmp);
+		free(ps->ps_Path);
+		free(ps);
+	}
+	if ((fd = open(TSDir, O_RDONLY|O_CLOEXEC)) >= 0) {
+		fsync(fd);
+		close(fd);
 	}
 }
 
 void
 SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 {
-	CronFile **pfile;
 	CronFile *file;
+
+	/*
+	 * Delete any existing copy of this CronFile
+	 */
+	if ((file = FindFile(dpath, fileName)) != NULL)
+		DeleteFile(file);
+
+	if ((file = ParseFile(dpath, fileName, userName)) != NULL)
+		LinkFile(file);
+}
+
+/*
+ * ParseFiles() - parse count tasks from dpath, spread over up to
+ * PARSE_THREADS threads, this one included
+ *
+ * Parsing only builds each task's CronFile; it doesn't touch the
+ * database, so the files can be parsed in any order, and linked in after.
+ */
+void
+ParseFiles(const char *dpath, ParseTask *tasks, int count)
+{
+	pthread_t threads[PARSE_THREADS - 1];
+	ParsePool pool;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int started = 0;
+	int n;
+
+	if (nthreads > PARSE_THREADS)
+		nthreads = PARSE_THREADS;
+	if (nthreads > count)
+		nthreads = count;
+
+	pool.pp_DPath = dpath;
+	pool.pp_Tasks = tasks;
+	pool.pp_Count = count;
+	pool.pp_Next = 0;
+	pthread_mutex_init(&pool.pp_Lock, NULL);
+	/* if a thread can't be started, the others do its share */
+	while (started < nthreads - 1 && pthread_create(&threads[started], NULL, ParseWorker, &pool) == 0)
+		++started;
+	ParseWorker(&pool);
+	for (n = 0; n < started; ++n)
+		pthread_join(threads[n], NULL);
+	pthread_mutex_destroy(&pool.pp_Lock);
+	if (DebugOpt && count)
+		printlogf(LOG_DEBUG, "parsed %d files from %s with %d threads\n", count, dpath, started + 1);
+}
+
+/*
+ * ParseWorker() - parse the pool's tasks until there are none left
+ */
+void *
+ParseWorker(void *arg)
+{
+	ParsePool *pool = arg;
+	ParseTask *task;
+	int n;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->pp_Lock);
+		n = pool->pp_Next++;
+		pthread_mutex_unlock(&pool->pp_Lock);
+		if (n >= pool->pp_Count)
+			break;
+		task = &pool->pp_Tasks[n];
+		task->pt_File = ParseFile(pool->pp_DPath, task->pt_FileName, task->pt_UserName);
+	}
+	return(NULL);
+}
+
+/*
+ * ParseFile() - a CronFile for dpath/fileName, to be run as userName, or
+ * NULL if it can't be read or isn't DaemonUid's
+ *
+ * This mustn't touch the database, or anything else but the file it
+ * makes, since ParseFiles() runs it in several threads at once.
+ */
+CronFile *
+ParseFile(const char *dpath, const char *fileName, const char *userName)
+{
+	CronFile *file = NULL;
 	int maxEntries;
 	int maxLines;
 	char buf[RW_BUFFER]; /* max length for crontab lines */
@@ -329,42 +812,36 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 		maxEntries = MAXLINES;
 	maxLines = maxEntries * 10;
 
-	/*
-	 * Delete any existing copy of this CronFile
-	 */
-	pfile = &FileBase;
-	while ((file = *pfile) != NULL) {
-		if (file->cf_Deleted == 0 && strcmp(file->cf_DPath, dpath) == 0 &&
-				strcmp(file->cf_FileName, fileName) == 0
-		   ) {
-			DeleteFile(pfile);
-		} else {
-			pfile = &file->cf_Next;
-		}
-	}
-
 	if (!(path = concat(dpath, "/", fileName, NULL))) {
 		errno = ENOMEM;
-		perror("SynchronizeFile");
+		perror("ParseFile");
 		exit(1);
 	}
 	if ((fi = fopen(path, "r")) != NULL) {
 		struct stat sbuf;
 
 		if (fstat(fileno(fi), &sbuf) == 0 && sbuf.st_uid == DaemonUid) {
-			CronFile *file = calloc(1, sizeof(CronFile));
 			CronLine **pline;
 			time_t tnow = time(NULL);
 			tnow -= tnow % 60;
 
+			file = calloc(1, sizeof(CronFile));
 			file->cf_UserName = strdup(userName);
 			file->cf_FileName = strdup(fileName);
 			file->cf_DPath = strdup(dpath);
+			file->cf_Dev = sbuf.st_dev;
+			file->cf_Ino = sbuf.st_ino;
+			file->cf_Size = sbuf.st_size;
+			file->cf_Mtime = sbuf.st_mtim;
+			file->cf_Ctime = sbuf.st_ctim;
+			file->cf_Seen = 1;
 			pline = &file->cf_LineBase;
 
 			/* fgets reads at most size-1 chars until \n or EOF, then adds a\0; \n if present is stored in buf */
 			while (fgets(buf, sizeof(buf), fi) != NULL && --maxLines) {
 				CronLine line;
+				int spread = 0;
+				short overlap = 0;
 				char *ptr = buf;
 				int len;
 
@@ -446,15 +923,12 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 						if (line.cl_Delay == 0)
 							line.cl_Delay = 60;
 						/* all minutes are permitted */
-						for (j=0; j<60; ++j)
-							line.cl_Mins[j] = 1;
-						for (j=0; j<24; ++j)
-							line.cl_Hrs[j] = 1;
-						for (j=1; j<32; ++j)
-							/* days are numbered 1..31 */
-							line.cl_Days[j] = 1;
-						for (j=0; j<12; ++j)
-							line.cl_Mons[j] = 1;
+						line.cl_Mins = ALL_MINUTES;
+						line.cl_Hrs = ALL_HOURS;
+						/* days are numbered 1..31 */
+						line.cl_Days = ALL_M_DAYS & ~1;
+						line.cl_Mons = ALL_MONTHS;
+						FixDayDow(&line, ALL_W_DAYS);
 					}
 
 					while (*ptr == ' ' || *ptr == '\t')
@@ -464,16 +938,17 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 					/*
 					 * parse date ranges
 					 */
+					uint64_t mins = 0, hrs = 0, days = 0, mons = 0, dow = 0;
 
-					ptr = ParseField(file->cf_UserName, line.cl_Mins, FIELD_MINUTES, 0, 1,
+					ptr = ParseField(file->cf_UserName, &mins, FIELD_MINUTES, 0,
 							NULL, ptr);
-					ptr = ParseField(file->cf_UserName, line.cl_Hrs,  FIELD_HOURS, 0, 1,
+					ptr = ParseField(file->cf_UserName, &hrs,  FIELD_HOURS, 0,
 							NULL, ptr);
-					ptr = ParseField(file->cf_UserName, line.cl_Days, FIELD_M_DAYS, 0, 1,
+					ptr = ParseField(file->cf_UserName, &days, FIELD_M_DAYS, 0,
 							NULL, ptr);
-					ptr = ParseField(file->cf_UserName, line.cl_Mons, FIELD_MONTHS, -1, 1,
+					ptr = ParseField(file->cf_UserName, &mons, FIELD_MONTHS, -1,
 							MonAry, ptr);
-					ptr = ParseField(file->cf_UserName, line.cl_Dow,  FIELD_W_DAYS, 0, ALL_DOW,
+					ptr = ParseField(file->cf_UserName, &dow,  FIELD_W_DAYS, 0,
 							DowAry, ptr);
 					/*
 					 * check failure
@@ -482,15 +957,20 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 					if (ptr == NULL)
 						continue;
 
+					line.cl_Mins = mins;
+					line.cl_Hrs = hrs;
+					line.cl_Days = days;
+					line.cl_Mons = mons;
+
 					/*
 					 * fix days and dow - if one is not * and the other
 					 * is *, the other is set to 0, and vise-versa
 					 */
 
-					FixDayDow(&line);
+					FixDayDow(&line, dow);
 				}
 
-				/* check for ID=... and AFTER=... and FREQ=... */
+				/* check for ID=... and AFTER=... and FREQ=... and SPREAD=..., and MEM=... CPU=... IO=... */
 				do {
 					if (strncmp(ptr, ID_TAG, strlen(ID_TAG)) == 0) {
 						if (line.cl_JobName) {
@@ -506,7 +986,7 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 							 */
 							if (!(line.cl_Description = concat("job ", strsep(&ptr, " \t"), NULL))) {
 								errno = ENOMEM;
-								perror("SynchronizeFile");
+								perror("ParseFile");
 								exit(1);
 							}
 							line.cl_JobName = line.cl_Description + 4;
@@ -533,6 +1013,94 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 								ptr = NULL;
 							}
 						}
+					} else if (strncmp(ptr, SPREAD_TAG, strlen(SPREAD_TAG)) == 0) {
+						if (spread) {
+							/* only assign SPREAD_TAG once */
+							printlogf(LOG_WARNING, "failed parsing crontab for user %s: repeated %s\n", userName, ptr);
+							ptr = NULL;
+						} else {
+							char *base = ptr;
+							ptr += strlen(SPREAD_TAG);
+							ptr = ParseInterval(&spread, ptr);
+							if (!ptr) {
+								printlogf(LOG_WARNING, "failed parsing crontab for user %s: %s\n", userName, base);
+							} else if (*ptr != ' ' && *ptr != '\t') {
+								printlogf(LOG_WARNING, "failed parsing crontab for user %s: no command after %s\n", userName, base);
+								ptr = NULL;
+							}
+						}
+					} else if (strncmp(ptr, TIMEOUT_TAG, strlen(TIMEOUT_TAG)) == 0) {
+						if (line.cl_Timeout) {
+							/* only assign TIMEOUT_TAG once */
+							printlogf(LOG_WARNING, "failed parsing crontab for user %s: repeated %s\n", userName, ptr);
+							ptr = NULL;
+						} else {
+							char *base = ptr;
+							ptr += strlen(TIMEOUT_TAG);
+							ptr = ParseInterval(&line.cl_Timeout, ptr);
+							if (!ptr) {
+								printlogf(LOG_WARNING, "failed parsing crontab for user %s: %s\n", userName, base);
+							} else if (*ptr != ' ' && *ptr != '\t') {
+								printlogf(LOG_WARNING, "failed parsing crontab for user %s: no command after %s\n", userName, base);
+								ptr = NULL;
+							}
+						}
+					} else if (strncmp(ptr, OVERLAP_TAG, strlen(OVERLAP_TAG)) == 0) {
+						if (overlap) {
+							/* only assign OVERLAP_TAG once */
+							printlogf(LOG_WARNING, "failed parsing crontab for user %s: repeated %s\n", userName, ptr);
+							ptr = NULL;
+						} else {
+							char *base = ptr;
+							ptr += strlen(OVERLAP_TAG);
+							if (strncmp(ptr, "skip", 4) == 0) {
+								line.cl_Overlap = OVERLAP_SKIP;
+								ptr += 4;
+							} else if (strncmp(ptr, "queue", 5) == 0) {
+								line.cl_Overlap = OVERLAP_QUEUE;
+								ptr += 5;
+							} else if (strncmp(ptr, "kill", 4) == 0) {
+								line.cl_Overlap = OVERLAP_KILL;
+								ptr += 4;
+							}
+							if (*ptr != ' ' && *ptr != '\t') {
+								printlogf(LOG_WARNING, "failed parsing crontab for user %s: %s\n", userName, base);
+								ptr = NULL;
+							} else
+								overlap = 1;
+						}
+					} else if (strncmp(ptr, MEM_TAG, strlen(MEM_TAG)) == 0) {
+						if (line.cl_MemMax) {
+							/* only assign MEM_TAG once */
+							printlogf(LOG_WARNING, "failed parsing crontab for user %s: repeated %s\n", userName, ptr);
+							ptr = NULL;
+						} else {
+							char *base = ptr;
+							ptr = ParseSize(&line.cl_MemMax, ptr + strlen(MEM_TAG));
+							if (!ptr) {
+								printlogf(LOG_WARNING, "failed parsing crontab for user %s: %s\n", userName, base);
+							} else if (*ptr != ' ' && *ptr != '\t') {
+								printlogf(LOG_WARNING, "failed parsing crontab for user %s: no command after %s\n", userName, base);
+								ptr = NULL;
+							}
+						}
+					} else if (strncmp(ptr, CPU_TAG, strlen(CPU_TAG)) == 0 || strncmp(ptr, IO_TAG, strlen(IO_TAG)) == 0) {
+						int iscpu = (strncmp(ptr, CPU_TAG, strlen(CPU_TAG)) == 0);
+						int *weight = iscpu ? &line.cl_CpuWeight : &line.cl_IoWeight;
+						if (*weight) {
+							/* only assign CPU_TAG and IO_TAG once */
+							printlogf(LOG_WARNING, "failed parsing crontab for user %s: repeated %s\n", userName, ptr);
+							ptr = NULL;
+						} else {
+							/* cgroup v2 weights run from 1 to 10000, default 100 */
+							char *base = ptr;
+							long n = strtol(ptr + strlen(iscpu ? CPU_TAG : IO_TAG), &ptr, 10);
+							if (n < 1 || n > 10000 || (*ptr != ' ' && *ptr != '\t')) {
+								printlogf(LOG_WARNING, "failed parsing crontab for user %s: %s\n", userName, base);
+								ptr = NULL;
+							} else
+								*weight = n;
+						}
 					} else if (strncmp(ptr, WAIT_TAG, strlen(WAIT_TAG)) == 0) {
 						if (line.cl_Waiters) {
 							/* only assign WAIT_TAG once */
@@ -543,7 +1111,6 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 							char *name;
 							ptr += strlen(WAIT_TAG);
 							do {
-								CronLine *job, **pjob;
 								if (strcspn(ptr,",") < strcspn(ptr," \t"))
 									name = strsep(&ptr, ",");
 								else {
@@ -568,29 +1135,15 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 											*wsave = 0;
 									}
 									if (ptr) {
-										/* look for a matching CronLine */
-										pjob = &file->cf_LineBase;
-										while ((job = *pjob) != NULL) {
-											if (job->cl_JobName && strcmp(job->cl_JobName, name) == 0) {
-												CronWaiter *waiter = malloc(sizeof(CronWaiter));
-												CronNotifier *notif = malloc(sizeof(CronNotifier));
-												waiter->cw_Flag = -1;
-												waiter->cw_MaxWait = waitfor;
-												waiter->cw_NotifLine = job;
-												waiter->cw_Notifier = notif;
-												waiter->cw_Next = line.cl_Waiters;	/* add to head of line.cl_Waiters */
-												line.cl_Waiters = waiter;
-												notif->cn_Waiter = waiter;
-												notif->cn_Next = job->cl_Notifs;	/* add to head of job->cl_Notifs */
-												job->cl_Notifs = notif;
-												break;
-											} else
-												pjob = &job->cl_Next;
-										}
-										if (!job) {
-											printlogf(LOG_WARNING, "failed parsing crontab for user %s: unknown job %s\n", userName, name);
-											/* we can continue parsing this line, we just don't install any CronWaiter for the requested job */
-										}
+										/* the matching CronLine is found by ResolveWaiters, so it may come later in the file */
+										CronWaiter *waiter = malloc(sizeof(CronWaiter));
+										waiter->cw_Flag = -1;
+										waiter->cw_MaxWait = waitfor;
+										waiter->cw_NotifLine = NULL;
+										waiter->cw_Notifier = NULL;
+										waiter->cw_Name = strdup(name);
+										waiter->cw_Next = line.cl_Waiters;	/* add to head of line.cl_Waiters */
+										line.cl_Waiters = waiter;
 									}
 								}
 							} while (ptr && more);
@@ -601,7 +1154,8 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 						break;
 					while (*ptr == ' ' || *ptr == '\t')
 						++ptr;
-				} while (!line.cl_JobName || !line.cl_Waiters || !line.cl_Freq);
+				} while (!line.cl_JobName || !line.cl_Waiters || !line.cl_Freq || !spread ||
+						!line.cl_MemMax || !line.cl_CpuWeight || !line.cl_IoWeight || !line.cl_Timeout || !overlap);
 
 				if (line.cl_JobName && (!ptr || *line.cl_JobName == 0)) {
 					/* we're aborting, or ID= was empty */
@@ -620,8 +1174,7 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 						pwaiters = &line.cl_Waiters;
 						while ((waiters = *pwaiters) != NULL) {
 							*pwaiters = waiters->cw_Next;
-							/* leave the Notifier allocated but disabled */
-							waiters->cw_Notifier->cn_Waiter = NULL;
+							free(waiters->cw_Name);
 							free(waiters);
 						}
 					}
@@ -634,10 +1187,18 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 				 */
 				line.cl_Shell = strdup(ptr);
 
+				/*
+				 * SPREAD= starts the job a fixed number of seconds into
+				 * the window, the same every time for the same user and job
+				 */
+				if (spread)
+					line.cl_Spread = HashString(HashString(HASH_INIT, userName),
+							line.cl_JobName ? line.cl_JobName : line.cl_Shell) % spread;
+
 				if (line.cl_Delay > 0) {
 					if (!(line.cl_Timestamp = concat(TSDir, "/", userName, ".", line.cl_JobName, NULL))) {
 						errno = ENOMEM;
-						perror("SynchronizeFile");
+						perror("ParseFile");
 						exit(1);
 					}
 					line.cl_NotUntil = tnow + line.cl_Delay;
@@ -657,20 +1218,47 @@ SynchronizeFile(const char *dpath, const char *fileName, const char *userName)
 				/* copy working CronLine to newly allocated one */
 				**pline = line;
 
+				/* the first job with a name is the one AFTER= and prodding find */
+				if (line.cl_JobName && !FindJob(file, line.cl_JobName))
+					HashAdd(&file->cf_Jobs, HashString(HASH_INIT, line.cl_JobName), *pline);
+
 				pline = &((*pline)->cl_Next);
 			}
 
 			*pline = NULL;
 
-			file->cf_Next = FileBase;
-			FileBase = file;
-
 			if (maxLines == 0 || maxEntries == 0)
 				printlogf(LOG_WARNING, "maximum number of lines reached for user %s\n", userName);
 		}
 		fclose(fi);
 	}
 	free(path);
+	return(file);
+}
+
+/*
+ * LinkFile() - add a newly parsed file to the database, and schedule its lines
+ */
+void
+LinkFile(CronFile *file)
+{
+	CronLine *line;
+
+	ResolveWaiters(file);
+
+	file->cf_Next = FileBase;
+	file->cf_PPrev = &FileBase;
+	if (FileBase)
+		FileBase->cf_PPrev = &file->cf_Next;
+	FileBase = file;
+	file->cf_UserNode = HashAdd(&FilesByUser, HashString(HASH_INIT, file->cf_UserName), file);
+	file->cf_PathNode = HashAdd(&FilesByPath, PathHash(file->cf_DPath, file->cf_FileName), file);
+
+	for (line = file->cf_LineBase; line; line = line->cl_Next) {
+		line->cl_File = file;
+		ScheduleLine(line, SchedTime);
+	}
+	SnapshotDirty = 1;
 }
 
 char *
@@ -701,8 +1289,40 @@ ParseInterval(int *interval, char *ptr)
 		return (NULL);
 }
 
+/*
+ * ParseSize() - a byte count, with an optional K, M or G suffix
+ */
 char *
-ParseField(char *user, char *ary, int modvalue, int offset, int onvalue, const char **names, char *ptr)
+ParseSize(int64_t *size, char *ptr)
+{
+	int64_t n = 0;
+
+	if (*ptr >= '0' && *ptr <= '9' && (n = strtoll(ptr, &ptr, 10)) > 0) {
+		switch (*ptr) {
+			case 'G':
+			case 'g':
+				n *= 1024;
+				/* fall through */
+			case 'M':
+			case 'm':
+				n *= 1024;
+				/* fall through */
+			case 'K':
+			case 'k':
+				n *= 1024;
+				++ptr;
+				break;
+		}
+	}
+	if (n > 0) {
+		*size = n;
+		return(ptr);
+	} else
+		return(NULL);
+}
+
+char *
+ParseField(char *user, uint64_t *mask, int modvalue, int offset, const char **names, char *ptr)
 {
 	char *base = ptr;
 	int n1 = -1;
@@ -762,19 +1382,24 @@ ParseField(char *user, char *ary, int modvalue, int offset, int onvalue, const c
 
 		/*
 		 * collapse single-value ranges, handle skipmark, and fill
-		 * in the character array appropriately.
+		 * in the mask appropriately.
 		 */
 
 		if (n2 < 0)
 			n2 = n1;
 
+		if (n1 < 0) {
+			/* e.g. month 0 */
+			printlogf(LOG_WARNING, "failed parsing crontab for user %s: %s\n", user, base);
+			return(NULL);
+		}
 		n2 = n2 % modvalue;
 
 		if (*ptr == '/')
 			skip = strtol(ptr + 1, &ptr, 10);
 
 		/*
-		 * fill array, using a failsafe is the easiest way to prevent
+		 * fill mask, using a failsafe is the easiest way to prevent
 		 * an endless loop
 		 */
 
@@ -787,7 +1412,7 @@ ParseField(char *user, char *ary, int modvalue, int offset, int onvalue, const c
 				n1 = (n1 + 1) % modvalue;
 
 				if (--s0 == 0) {
-					ary[n1] = onvalue;
+					*mask |= (uint64_t)1 << n1;
 					s0 = skip;
 				}
 			} while (n1 != n2 && --failsafe);
@@ -816,10 +1441,7 @@ ParseField(char *user, char *ary, int modvalue, int offset, int onvalue, const c
 		int i;
 
 		for (i = 0; i < modvalue; ++i)
-			if (modvalue == FIELD_W_DAYS)
-				printlogf(LOG_DEBUG, "%2x ", ary[i]);
-			else
-				printlogf(LOG_DEBUG, "%d", ary[i]);
+			printlogf(LOG_DEBUG, "%d", (int)(*mask >> i) & 1);
 		printlogf(LOG_DEBUG, "\n");
 	}
 
@@ -836,83 +1458,197 @@ ParseField(char *user, char *ary, int modvalue, int offset, int onvalue, const c
  *    specified DoW. DoM > 5 means the last such DoW in that month
  */
 void
-FixDayDow(CronLine *line)
+FixDayDow(CronLine *line, uint64_t dow)
 {
 	unsigned short i;
-	short DowStar = 1;
-	short DomStar = 1;
-	char mask = 0;
-
-	for (i = 0; i < arysize(line->cl_Dow); ++i) {
-		if (line->cl_Dow[i] == 0) {
-			/* '*' was NOT specified in the DoW field on this CronLine */
-			DowStar = 0;
-			break;
+	char mask = ALL_DOW;
+
+	/* Cases 1, 2 and 3 need no mask: each listed DoW matches every week */
+	if (dow != ALL_W_DAYS && line->cl_Days != ALL_M_DAYS) {
+		/* Set individual bits within the DoW mask... */
+		mask = 0;
+		for (i = 1; i < FIELD_M_DAYS; ++i) {
+			if (line->cl_Days & ((uint32_t)1 << i)) {
+				if (i < 6)
+					mask |= 1 << (i - 1);
+				else
+					mask |= LAST_DOW;
+			}
 		}
+
+		/* case 4 relies on the DoW value to guard the date instead of using the
+		 * cl_Days field for this purpose; so we must set all of cl_Days
+		 * to allow the DoW bitmask test to be made
+		 */
+		line->cl_Days = ALL_M_DAYS;
 	}
 
-	for (i = 0; i < arysize(line->cl_Days); ++i) {
-		if (line->cl_Days[i] == 0) {
-			/* '*' was NOT specified in the Date field on this CronLine */
-			DomStar = 0;
-			break;
+	/* and apply the mask to each DoW */
+	line->cl_Dow = 0;
+	for (i = 0; i < FIELD_W_DAYS; ++i)
+		if (dow & (1 << i))
+			line->cl_Dow |= (uint64_t)(unsigned char)mask << (8 * i);
+}
+
+/*
+ * ResolveWaiters() - connect each AFTER= name to the job it names
+ *
+ * Runs once the whole file is read, so a job can wait for one defined later
+ * in the file.  Waits for unknown jobs, or for the job itself, are dropped
+ * with a warning, and so are any that would make jobs wait on each other
+ * in a circle.
+ */
+void
+ResolveWaiters(CronFile *file)
+{
+	CronLine *line;
+	CronLine *job;
+	CronWaiter **pwaiter;
+	CronWaiter *waiter;
+	CronNotifier *notif;
+	int waits = 0;
+
+	for (line = file->cf_LineBase; line; line = line->cl_Next) {
+		pwaiter = &line->cl_Waiters;
+		while ((waiter = *pwaiter) != NULL) {
+			if ((job = FindJob(file, waiter->cw_Name)) == NULL) {
+				printlogf(LOG_WARNING, "failed parsing crontab for user %s: unknown job %s\n", file->cf_UserName, waiter->cw_Name);
+				DropWaiter(pwaiter);
+			} else if (job == line) {
+				printlogf(LOG_WARNING, "failed parsing crontab for user %s: job %s waits for itself\n", file->cf_UserName, waiter->cw_Name);
+				DropWaiter(pwaiter);
+			} else {
+				notif = malloc(sizeof(CronNotifier));
+				waiter->cw_NotifLine = job;
+				waiter->cw_Notifier = notif;
+				notif->cn_Waiter = waiter;
+				notif->cn_Next = job->cl_Notifs;	/* add to head of job->cl_Notifs */
+				job->cl_Notifs = notif;
+				free(waiter->cw_Name);
+				waiter->cw_Name = NULL;
+				pwaiter = &waiter->cw_Next;
+				++waits;
+			}
 		}
 	}
+	if (waits)
+		BreakCycles(file);
+}
 
-	/* When cases 1, 2 or 3 there is nothing left to do */
-	if (DowStar || DomStar)
-		return;
+/*
+ * BreakCycles() - drop waits that close a circle
+ *
+ * A depth-first walk along waiter -> notifier edges; an edge back to a job
+ * still on the walk's stack closes a circle, and is dropped.
+ */
+void
+BreakCycles(CronFile *file)
+{
+	CronLine *line;
+	CronLine *job;
+	CronLine **stack;
+	CronWaiter ***next;
+	CronWaiter *waiter;
+	int n = 0;
+	int sp;
 
-	/* Set individual bits within the DoW mask... */
-	for (i = 0; i < arysize(line->cl_Days); ++i) {
-		if (line->cl_Days[i]) {
-			if (i < 6)
-				mask |= 1 << (i - 1);
-			else
-				mask |= LAST_DOW;
-		}
+	for (line = file->cf_LineBase; line; line = line->cl_Next) {
+		line->cl_Visit = 0;
+		++n;
+	}
+	if (!(stack = malloc(n * sizeof(CronLine *))) || !(next = malloc(n * sizeof(CronWaiter **)))) {
+		errno = ENOMEM;
+		perror("BreakCycles");
+		exit(1);
 	}
 
-	/* and apply the mask to each DoW element */
-	for (i = 0; i < arysize(line->cl_Dow); ++i) {
-		if (line->cl_Dow[i])
-			line->cl_Dow[i] = mask;
-		else
-			line->cl_Dow[i] = 0;
+	for (line = file->cf_LineBase; line; line = line->cl_Next) {
+		if (line->cl_Visit)
+			continue;
+		sp = 0;
+		stack[0] = line;
+		next[0] = &line->cl_Waiters;
+		line->cl_Visit = 1;
+		while (sp >= 0) {
+			if ((waiter = *next[sp]) == NULL) {
+				/* done with this job */
+				stack[sp--]->cl_Visit = 2;
+				continue;
+			}
+			job = waiter->cw_NotifLine;
+			if (job->cl_Visit == 1) {
+				printlogf(LOG_WARNING, "failed parsing crontab for user %s: %s and job %s wait for each other\n",
+						file->cf_UserName, stack[sp]->cl_Description, job->cl_JobName);
+				DropWaiter(next[sp]);
+				continue;
+			}
+			next[sp] = &waiter->cw_Next;
+			if (job->cl_Visit == 0) {
+				job->cl_Visit = 1;
+				stack[++sp] = job;
+				next[sp] = &job->cl_Waiters;
+			}
+		}
 	}
+	free(stack);
+	free(next);
+}
 
-	/* case 4 relies on the DoW value to guard the date instead of using the
-	 * cl_Days field for this purpose; so we must set each element of cl_Days
-	 * to 1 to allow the DoW bitmask test to be made
-	 */
-	memset(line->cl_Days, 1, sizeof(line->cl_Days));
+/*
+ * DropWaiter() - unlink and free *pwaiter, and its notifier if it has one
+ */
+void
+DropWaiter(CronWaiter **pwaiter)
+{
+	CronWaiter *waiter = *pwaiter;
+	CronNotifier **pnotif;
+
+	if (waiter->cw_Notifier) {
+		pnotif = &waiter->cw_NotifLine->cl_Notifs;
+		while (*pnotif != waiter->cw_Notifier)
+			pnotif = &(*pnotif)->cn_Next;
+		*pnotif = waiter->cw_Notifier->cn_Next;
+		free(waiter->cw_Notifier);
+	}
+	*pwaiter = waiter->cw_Next;
+	free(waiter->cw_Name);
+	free(waiter);
 }
 
 /*
  *  DeleteFile() - destroy a CronFile.
  *
- *  The CronFile (*pfile) is destroyed if possible, and marked cf_Deleted
- *  if there are still active processes running on it.  *pfile is relinked
- *  on success.
+ *  The CronFile is destroyed and unlinked if possible, and marked
+ *  cf_Deleted if there are still active processes running on it.
+ *  Either way it can no longer be looked up.
  */
 void
-DeleteFile(CronFile **pfile)
+DeleteFile(CronFile *file)
 {
-	CronFile *file = *pfile;
 	CronLine **pline = &file->cf_LineBase;
 	CronLine *line;
 	CronWaiter **pwaiters, *waiters;
 	CronNotifier **pnotifs, *notifs;
 
+	if (file->cf_Deleted == 0) {
+		HashDel(&FilesByUser, file->cf_UserNode);
+		HashDel(&FilesByPath, file->cf_PathNode);
+		HashFree(&file->cf_Jobs);
+		SnapshotDirty = 1;
+	}
 	file->cf_Running = 0;
 	file->cf_Deleted = 1;
 
 	while ((line = *pline) != NULL) {
+		UnscheduleLine(line);
 		if (line->cl_Pid > JOB_NONE) {
-			file->cf_Running = 1;
+			/* keep it until ReapJobs sees it exit */
+			++file->cf_Running;
 			pline = &line->cl_Next;
 		} else {
 			*pline = line->cl_Next;
+			if (line->cl_Pid == JOB_QUEUED)
+				UnqueueJob(line);
 			free(line->cl_Shell);
 
 			if (line->cl_JobName)
@@ -922,6 +1658,7 @@ DeleteFile(CronFile **pfile)
 				free(line->cl_Description);
 			if (line->cl_Timestamp)
 				free(line->cl_Timestamp);
+			FreeStats(line);
 
 			pnotifs = &line->cl_Notifs;
 			while ((notifs = *pnotifs) != NULL) {
@@ -944,7 +1681,9 @@ DeleteFile(CronFile **pfile)
 		}
 	}
 	if (file->cf_Running == 0) {
-		*pfile = file->cf_Next;
+		*file->cf_PPrev = file->cf_Next;
+		if (file->cf_Next)
+			file->cf_Next->cf_PPrev = file->cf_PPrev;
 		free(file->cf_DPath);
 		free(file->cf_FileName);
 		free(file->cf_UserName);
@@ -957,8 +1696,9 @@ DeleteFile(CronFile **pfile)
  * TestJobs()
  *
  * determine which jobs need to be run.  Under normal conditions, the
- * period is about a minute (one scan).  Worst case it will be one
- * hour (60 scans).
+ * period is about a minute.  Worst case it will be one hour.  Only lines
+ * whose next fire time falls in the period are looked at, and each is
+ * looked at once however long the period is; see sched.c.
  */
 
 int
@@ -969,79 +1709,73 @@ TestJobs(time_t t1, time_t t2)
 	CronFile *file;
 	CronLine *line;
 
-	PrintFile(FileBase, "TestJobs()", __FILE__, __LINE__);
-	for (file = FileBase; file; file = file->cf_Next) {
-		if (file->cf_Deleted)
-			continue;
-		for (line = file->cf_LineBase; line; line = line->cl_Next) {
-			struct CronWaiter *waiter;
+	if (DebugOpt)
+		PrintFile(FileBase, "TestJobs()", __FILE__, __LINE__);
+	if (WaitersChanged) {
+		/* some notifier has finished since we last looked */
+		WaitersChanged = 0;
+		for (file = FileBase; file; file = file->cf_Next) {
+			if (file->cf_Deleted)
+				continue;
+			for (line = file->cf_LineBase; line; line = line->cl_Next) {
+				struct CronWaiter *waiter;
 
-			if (line->cl_Pid == JOB_WAITING) {
-				/* can job stop waiting? */
-				int ready = 1;
-				waiter = line->cl_Waiters;
-				while (waiter != NULL) {
-					if (waiter->cw_Flag > 0) {
-						/* notifier exited unsuccessfully */
-						ready = 2;
-						break;
-					} else if (waiter->cw_Flag < 0)
-						/* still waiting, notifier hasn't run to completion */
-						ready = 0;
-					waiter = waiter->cw_Next;
-				}
-				if (ready == 2) {
-					if (DebugOpt)
-						printlogf(LOG_DEBUG, "cancelled waiting: user %s %s\n", file->cf_UserName, line->cl_Description);
-					line->cl_Pid = JOB_NONE;
-				} else if (ready) {
-					if (DebugOpt)
-						printlogf(LOG_DEBUG, "finished waiting: user %s %s\n", file->cf_UserName, line->cl_Description);
-					nJobs += ArmJob(file, line, 0, -1);
-					/*
-					 if (line->cl_NotUntil)
-						 line->cl_NotUntil = t2;
-					*/
+				if (line->cl_Pid == JOB_WAITING) {
+					/* can job stop waiting? */
+					int ready = 1;
+					waiter = line->cl_Waiters;
+					while (waiter != NULL) {
+						if (waiter->cw_Flag > 0) {
+							/* notifier exited unsuccessfully */
+							ready = 2;
+							break;
+						} else if (waiter->cw_Flag < 0)
+							/* still waiting, notifier hasn't run to completion */
+							ready = 0;
+						waiter = waiter->cw_Next;
+					}
+					if (ready == 2) {
+						if (DebugOpt)
+							printlogf(LOG_DEBUG, "cancelled waiting: user %s %s\n", file->cf_UserName, line->cl_Description);
+						line->cl_Pid = JOB_NONE;
+					} else if (ready) {
+						if (DebugOpt)
+							printlogf(LOG_DEBUG, "finished waiting: user %s %s\n", file->cf_UserName, line->cl_Description);
+						nJobs += ArmJob(file, line, 0, -1);
+						/*
+						 if (line->cl_NotUntil)
+							 line->cl_NotUntil = t2;
+						*/
+					}
 				}
 			}
 		}
 	}
 
 	/*
-	 * Find jobs > t1 and <= t2
+	 * Find jobs > t1 and <= t2.  A line popped with a fire time <= t1 was
+	 * queued before a time change; it's just requeued from t1, which may
+	 * well put it back inside the period.
 	 */
 
-	for (t = t1 - t1 % 60; t <= t2; t += 60) {
+	while ((line = PopDueLine(t2)) != NULL) {
+		t = line->cl_NextRun;
+		file = line->cl_File;
 		if (t > t1) {
-			struct tm *tp = localtime(&t);
-
-			char n_wday = 1 << ((tp->tm_mday - 1) / 7);
-			if (n_wday >= FOURTH_DOW) {
-				struct tm tnext = *tp;
-				tnext.tm_mday += 7;
-				if (mktime(&tnext) != (time_t)-1 && tnext.tm_mon != tp->tm_mon)
-					n_wday |= LAST_DOW;	/* last dow in month is always recognized as 6th bit */
-			}
-
-			for (file = FileBase; file; file = file->cf_Next) {
-				if (file->cf_Deleted)
-					continue;
-				for (line = file->cf_LineBase; line; line = line->cl_Next) {
-					if ((line->cl_Pid == JOB_WAITING || line->cl_Pid == JOB_NONE) && (line->cl_Freq == 0 || (line->cl_Freq > 0 && t2 >= line->cl_NotUntil))) {
-						/* (re)schedule job? */
-						if (line->cl_Mins[tp->tm_min] &&
-								line->cl_Hrs[tp->tm_hour] &&
-								(line->cl_Days[tp->tm_mday] && n_wday & line->cl_Dow[tp->tm_wday])
-						   ) {
-							if (line->cl_NotUntil)
-								line->cl_NotUntil = t2 - t2 % 60 + line->cl_Delay; /* save what minute this job was scheduled/started waiting, plus cl_Delay */
-							nJobs += ArmJob(file, line, t1, t2);
-						}
-					}
-				}
+			if ((line->cl_Pid == JOB_WAITING || line->cl_Pid == JOB_NONE) && (line->cl_Freq == 0 || (line->cl_Freq > 0 && t2 >= line->cl_NotUntil))) {
+				/* (re)schedule job */
+				if (line->cl_NotUntil)
+					line->cl_NotUntil = t2 - t2 % 60 + line->cl_Delay; /* save what minute this job was scheduled/started waiting, plus cl_Delay */
+				nJobs += ArmJob(file, line, t1, t2);
+			} else if (line->cl_Pid > JOB_NONE && line->cl_Freq == 0) {
+				/* the last run is still going; its OVERLAP= says what to do */
+				nJobs += ArmJob(file, line, t1, t2);
 			}
-		}
+			ScheduleLine(line, t2);
+		} else
+			ScheduleLine(line, t1);
 	}
+	SchedTime = t2;
 	return(nJobs);
 }
 
@@ -1055,8 +1789,30 @@ ArmJob(CronFile *file, CronLine *line, time_t t1, time_t t2)
 {
 	struct CronWaiter *waiter;
 	if (line->cl_Pid > JOB_NONE) {
-		printlogf(LOG_NOTICE, "process already running (%d): user %s %s\n",
-				line->cl_Pid,
+		if (line->cl_Overlap == OVERLAP_SKIP || line->cl_Pending) {
+			printlogf(LOG_NOTICE, "process already running (%d), %lu runs skipped: user %s %s\n",
+					line->cl_Pid,
+					++line->cl_Skipped,
+					file->cf_UserName,
+					line->cl_Description
+				);
+		} else {
+			/* ReapJobs arms it again when the running one exits */
+			line->cl_Pending = 1;
+			line->cl_PendT1 = t1;
+			line->cl_PendT2 = t2;
+			printlogf(LOG_NOTICE, "process already running (%d), %s, %lu runs deferred: user %s %s\n",
+					line->cl_Pid,
+					(line->cl_Overlap == OVERLAP_KILL) ? "stopping it to run again" : "will run again when it exits",
+					++line->cl_Deferred,
+					file->cf_UserName,
+					line->cl_Description
+				);
+			if (line->cl_Overlap == OVERLAP_KILL && !line->cl_Killed)
+				StopJob(line, time(NULL));
+		}
+	} else if (line->cl_Pid == JOB_QUEUED) {
+		printlogf(LOG_NOTICE, "already queued to run: user %s %s\n",
 				file->cf_UserName,
 				line->cl_Description
 			);
@@ -1084,34 +1840,16 @@ ArmJob(CronFile *file, CronLine *line, time_t t1, time_t t2)
 				waiter->cw_Flag = -1;
 				line->cl_Pid = JOB_WAITING;
 			} else {
-				time_t t;
 				if (waiter->cw_MaxWait == 0)
 					/* when no MaxWait interval specified, we always wait */
 					waiter->cw_Flag = -1;
 				else if (waiter->cw_NotifLine->cl_Freq == 0 || (waiter->cw_NotifLine->cl_Freq > 0 && t2 + waiter->cw_MaxWait >= waiter->cw_NotifLine->cl_NotUntil)) {
 					/* default is don't wait */
 					waiter->cw_Flag = 0;
-					for (t = t1 - t1 % 60; t <= t2; t += 60) {
-						if (t > t1) {
-							struct tm *tp = localtime(&t);
-
-							char n_wday = 1 << ((tp->tm_mday - 1) / 7);
-							if (n_wday >= FOURTH_DOW) {
-								struct tm tnext = *tp;
-								tnext.tm_mday += 7;
-								if (mktime(&tnext) != (time_t)-1 && tnext.tm_mon != tp->tm_mon)
-									n_wday |= LAST_DOW;	/* last dow in month is always recognized as 6th */
-							}
-							if (line->cl_Mins[tp->tm_min] &&
-									line->cl_Hrs[tp->tm_hour] &&
-									(line->cl_Days[tp->tm_mday] && n_wday & line->cl_Dow[tp->tm_wday])
-							   ) {
-								/* notifier will run soon enough, we wait for it */
-								waiter->cw_Flag = -1;
-								line->cl_Pid = JOB_WAITING;
-								break;
-							}
-						}
+					if (FiresWithin(line, t1, t2)) {
+						/* notifier will run soon enough, we wait for it */
+						waiter->cw_Flag = -1;
+						line->cl_Pid = JOB_WAITING;
 					}
 				}
 			}
@@ -1188,44 +1926,137 @@ TestStartupJobs(void)
 	return(nJobs);
 }
 
+/*
+ * RunJobs() - start armed jobs, as far as -j and -J allow
+ *
+ * Armed jobs join the back of JobQueue, and jobs are started from the
+ * front of it while there are free slots.  A job whose user is at the
+ * -J limit stays where it is, without holding up other users' jobs.
+ * Called again as jobs finish, while any are queued.
+ */
+
 void
 RunJobs(void)
 {
 	CronFile *file;
 	CronLine *line;
+	CronLine *next;
+	time_t t = time(NULL);
+	int was = JobsQueued;
 
 	for (file = FileBase; file; file = file->cf_Next) {
 		if (file->cf_Ready) {
 			file->cf_Ready = 0;
 
 			for (line = file->cf_LineBase; line; line = line->cl_Next) {
-				if (line->cl_Pid == JOB_ARMED) {
-
-					RunJob(file, line);
-
-					printlogf(LOG_INFO, "FILE %s/%s USER %s PID %3d %s\n",
-							file->cf_DPath,
-							file->cf_FileName,
-							file->cf_UserName,
-							line->cl_Pid,
-							line->cl_Description
-						);
-					if (line->cl_Pid < JOB_NONE)
-						/* QUESTION how could this happen? RunJob will leave cl_Pid set to 0 or the actual pid */
-						file->cf_Ready = 1;
-					else if (line->cl_Pid > JOB_NONE)
-						file->cf_Running = 1;
-				}
+				if (line->cl_Pid == JOB_ARMED)
+					QueueJob(line, t);
 			}
 		}
 	}
+
+	for (line = JobQueue; line; line = next) {
+		next = line->cl_QNext;
+		file = line->cl_File;
+		if (MaxJobs > 0 && RunningJobs.ht_Count >= MaxJobs)
+			break;
+		if (MaxUserJobs > 0 && CountUserJobs(file->cf_UserName, 0) >= MaxUserJobs)
+			continue;
+		UnqueueJob(line);
+		if (t > line->cl_Queued)
+			printlogf(LOG_INFO, "started after %d seconds in queue, %d still queued: user %s %s\n",
+					(int)(t - line->cl_Queued),
+					JobsQueued,
+					file->cf_UserName,
+					line->cl_Description
+				);
+
+		RunJob(file, line);
+
+		printlogf(LOG_INFO, "FILE %s/%s USER %s PID %3d %s\n",
+				file->cf_DPath,
+				file->cf_FileName,
+				file->cf_UserName,
+				line->cl_Pid,
+				line->cl_Description
+			);
+		if (line->cl_Pid > JOB_NONE) {
+			HashAdd(&RunningJobs, HashInt(line->cl_Pid), line);
+			CountUserJobs(file->cf_UserName, 1);
+			++file->cf_Running;
+		}
+	}
+
+	if (JobsQueued > was)
+		printlogf(LOG_NOTICE, "%d jobs queued, %ld running\n", JobsQueued, RunningJobs.ht_Count);
 }
 
 /*
- * CheckJobs() - check for job completion
+ * QueueJob() - add an armed line to the back of JobQueue
+ */
+void
+QueueJob(CronLine *line, time_t t)
+{
+	line->cl_Pid = JOB_QUEUED;
+	line->cl_Queued = t;
+	line->cl_QNext = NULL;
+	line->cl_QPPrev = JobQueueTail;
+	*JobQueueTail = line;
+	JobQueueTail = &line->cl_QNext;
+	++JobsQueued;
+}
+
+void
+UnqueueJob(CronLine *line)
+{
+	*line->cl_QPPrev = line->cl_QNext;
+	if (line->cl_QNext)
+		line->cl_QNext->cl_QPPrev = line->cl_QPPrev;
+	else
+		JobQueueTail = line->cl_QPPrev;
+	line->cl_Pid = JOB_ARMED;
+	--JobsQueued;
+}
+
+/*
+ * CountUserJobs() - add delta to user's count of running jobs, and return it
+ */
+int
+CountUserJobs(const char *user, int delta)
+{
+	unsigned long hash = HashString(HASH_INIT, user);
+	UserLoad *load = NULL;
+	HashNode *hn;
+	int n;
+
+	for (hn = HashFirst(&UserLoads, hash); hn; hn = HashNext(hn)) {
+		load = hn->hn_Data;
+		if (strcmp(load->ul_Name, user) == 0)
+			break;
+	}
+	if (!hn) {
+		if (delta <= 0)
+			return(0);
+		if (!(load = malloc(sizeof(UserLoad))) || !(load->ul_Name = strdup(user))) {
+			errno = ENOMEM;
+			perror("CountUserJobs");
+			exit(1);
+		}
+		load->ul_Running = 0;
+		hn = HashAdd(&UserLoads, hash, load);
+	}
+	if ((n = load->ul_Running += delta) <= 0) {
+		HashDel(&UserLoads, hn);
+		free(load->ul_Name);
+		free(load);
+	}
+	return(n);
+}
+
+/*
+ * CheckJobs() - count jobs still running, queued or waiting
  *
- * Check for job completion, return number of CronFiles still running after
- * all done.
+ * Jobs are reaped as they finish, by ReapJobs(); this only counts.
  */
 
 int
@@ -1233,33 +2064,9 @@ CheckJobs(void)
 {
 	CronFile *file;
 	CronLine *line;
-	int nStillRunning = 0;
+	int nStillRunning = RunningJobs.ht_Count + JobsQueued;
 
 	for (file = FileBase; file; file = file->cf_Next) {
-		if (file->cf_Running) {
-			file->cf_Running = 0;
-
-			for (line = file->cf_LineBase; line; line = line->cl_Next) {
-				if (line->cl_Pid > JOB_NONE) {
-					int status;
-					int r = waitpid(line->cl_Pid, &status, WNOHANG);
-
-					/* waitpid returns -1 for error, 0 if cl_Pid still running, cl_Pid if it's dead */
-
-					if (r < 0 || r == line->cl_Pid) {
-						if (r > 0 && WIFEXITED(status))
-							status = WEXITSTATUS(status);
-						else
-							status = 1;
-						EndJob(file, line, status);
-
-					} else if (r == 0) {
-						file->cf_Running = 1;
-					}
-				}
-			}
-			nStillRunning += file->cf_Running;
-		}
 		/* For the purposes of this check, increase the "still running" counter if a file has lines that are waiting */
 		if (file->cf_Running == 0) {
 			for (line = file->cf_LineBase; line; line = line->cl_Next) {
@@ -1273,6 +2080,124 @@ CheckJobs(void)
 	return(nStillRunning);
 }
 
+/*
+ * ReapJobs() - collect every child that has exited
+ *
+ * Called when SIGCHLD is pending.  Jobs are found by pid and ended; a
+ * CronFile deleted while its jobs ran is freed once the last one ends.
+ * Mailjobs have no line and are just reaped.
+ */
+
+void
+ReapJobs(void)
+{
+	CronFile *file;
+	CronLine *line;
+	HashNode *hn;
+	struct rusage ru;
+	pid_t pid;
+	int status;
+
+	while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+		for (hn = HashFirst(&RunningJobs, HashInt(pid)); hn; hn = HashNext(hn)) {
+			if (((CronLine *)hn->hn_Data)->cl_Pid == pid)
+				break;
+		}
+		if (!hn)
+			continue;
+		line = hn->hn_Data;
+		file = line->cl_File;
+		HashDel(&RunningJobs, hn);
+		RecordStats(file, line, status, &ru);
+
+		if (WIFEXITED(status))
+			status = WEXITSTATUS(status);
+		else
+			status = 1;
+		if (line->cl_Killed) {
+			/* stopped, it ran and failed, whatever it said as it went */
+			if (status == 0 || status == EAGAIN)
+				status = 1;
+		}
+		line->cl_Deadline = 0;
+		line->cl_Killed = 0;
+		CountUserJobs(file->cf_UserName, -1);
+		EndJob(file, line, status);
+
+		if (line->cl_Pending) {
+			/*
+			 * with OVERLAP=queue or kill, a run came due while it ran:
+			 * arm it as it would have been then, so it still waits for
+			 * its AFTER= jobs.  If it doesn't have to wait, it joins
+			 * the queue now, as RunJobs would.
+			 */
+			line->cl_Pending = 0;
+			if (!file->cf_Deleted && line->cl_Pid == JOB_NONE &&
+					ArmJob(file, line, line->cl_PendT1, line->cl_PendT2) && line->cl_Pid == JOB_ARMED)
+				QueueJob(line, time(NULL));
+		}
+
+		if (--file->cf_Running == 0 && file->cf_Deleted)
+			DeleteFile(file);
+	}
+}
+
+/*
+ * StopJob() - SIGTERM line's running job's process group; CheckTimeouts
+ * SIGKILLs it if it's still there TIMEOUT_GRACE seconds after t
+ */
+void
+StopJob(CronLine *line, time_t t)
+{
+	kill(-line->cl_Pid, SIGTERM);
+	line->cl_Killed = SIGTERM;
+	line->cl_Deadline = t + TIMEOUT_GRACE;
+}
+
+/*
+ * CheckTimeouts() - signal the running jobs past their deadline
+ *
+ * A job past its TIMEOUT= (or -T) gets SIGTERM, sent to its process
+ * group, and if it's still there TIMEOUT_GRACE seconds later, SIGKILL,
+ * to its group and to its cgroup with -g.  ReapJobs counts it failed
+ * when it goes.  Returns the next deadline of a running job, or 0.
+ */
+time_t
+CheckTimeouts(time_t t)
+{
+	CronLine *line;
+	HashNode *hn;
+	time_t next = 0;
+	int n;
+
+	for (n = 0; RunningJobs.ht_Buckets && n <= RunningJobs.ht_Mask; ++n) {
+		for (hn = RunningJobs.ht_Buckets[n]; hn; hn = hn->hn_Next) {
+			line = hn->hn_Data;
+			if (!line->cl_Deadline)
+				continue;
+			if (line->cl_Deadline <= t) {
+				if (!line->cl_Killed) {
+					printlogf(LOG_NOTICE, "timeout of %d seconds reached, sending SIGTERM: user %s %s\n",
+							line->cl_Timeout ? line->cl_Timeout : JobTimeout,
+							line->cl_File->cf_UserName, line->cl_Description);
+					StopJob(line, t);
+				} else {
+					printlogf(LOG_NOTICE, "still running %d seconds after SIGTERM, sending SIGKILL: user %s %s\n",
+							TIMEOUT_GRACE, line->cl_File->cf_UserName, line->cl_Description);
+					kill(-line->cl_Pid, SIGKILL);
+					CgroupKill(line);
+					line->cl_Killed = SIGKILL;
+					line->cl_Deadline = 0;
+					continue;
+				}
+			}
+			if (!next || line->cl_Deadline < next)
+				next = line->cl_Deadline;
+		}
+	}
+	return(next);
+}
+
 void
 PrintLine(CronLine *line)
 {
@@ -1286,26 +2211,28 @@ PrintLine(CronLine *line)
 	printlogf(LOG_DEBUG, "  Freq:    %s\n", (line->cl_Freq ?
 				(line->cl_Freq == -1 ? "(noauto)" : "(startup") : "(use arrays)"));
 	printlogf(LOG_DEBUG, "  PID:     %d\n", line->cl_Pid);
+	if (line->cl_Spread)
+		printlogf(LOG_DEBUG, "  Spread:  %ds\n", line->cl_Spread);
 
 	printlogf(LOG_DEBUG, "  Mins:    ");
-	for (i = 0; i < 60; ++i)
-		printlogf(LOG_DEBUG, "%d", line->cl_Mins[i]);
+	for (i = 0; i < FIELD_MINUTES; ++i)
+		printlogf(LOG_DEBUG, "%d", (int)(line->cl_Mins >> i) & 1);
 
 	printlogf(LOG_DEBUG, "\n  Hrs:     ");
-	for (i = 0; i < 24; ++i)
-		printlogf(LOG_DEBUG, "%d", line->cl_Hrs[i]);
+	for (i = 0; i < FIELD_HOURS; ++i)
+		printlogf(LOG_DEBUG, "%d", (int)(line->cl_Hrs >> i) & 1);
 
 	printlogf(LOG_DEBUG, "\n  Days:    ");
-	for (i = 0; i < 32; ++i)
-		printlogf(LOG_DEBUG, "%d", line->cl_Days[i]);
+	for (i = 0; i < FIELD_M_DAYS; ++i)
+		printlogf(LOG_DEBUG, "%d", (int)(line->cl_Days >> i) & 1);
 
 	printlogf(LOG_DEBUG, "\n  Mons:    ");
-	for (i = 0; i < 12; ++i)
-		printlogf(LOG_DEBUG, "%d", line->cl_Mons[i]);
+	for (i = 0; i < FIELD_MONTHS; ++i)
+		printlogf(LOG_DEBUG, "%d", (line->cl_Mons >> i) & 1);
 
 	printlogf(LOG_DEBUG, "\n  Dow:     ");
-	for (i = 0; i < 7; ++i)
-		printlogf(LOG_DEBUG, "%02x ", line->cl_Dow[i]);
+	for (i = 0; i < FIELD_W_DAYS; ++i)
+		printlogf(LOG_DEBUG, "%02x ", DOW_BITS(line, i) & 0xff);
 	printlogf(LOG_DEBUG, "\n\n");
 }
 
@@ -25,6 +25,13 @@
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
@@ -44,10 +51,18 @@
 #include <time.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #define Prototype extern
 #define arysize(ary)	(sizeof(ary)/sizeof((ary)[0]))
 
+/* index of the lowest set bit of a nonzero mask */
+#ifdef NO_BUILTIN_CTZ
+#define CTZ(mask)	Ctz64(mask)
+#else
+#define CTZ(mask)	__builtin_ctzll(mask)
+#endif
+
 #ifndef SCRONTABS
 #define SCRONTABS	"/etc/cron.d"
 #endif
@@ -73,9 +88,24 @@
 #ifndef CRONUPDATE
 #define CRONUPDATE	"cron.update"
 #endif
+#ifndef STAMPFILE
+#define STAMPFILE	"cron.stamps"	/* in TSDir, with -k */
+#endif
+#ifndef SNAPFILE
+#define SNAPFILE	"cron.snapshot"	/* in TSDir, with -p */
+#endif
 #ifndef TMPDIR
 #define TMPDIR		"/tmp"
 #endif
+#ifndef PASSWD_FILE
+#define PASSWD_FILE	"/etc/passwd"
+#endif
+#ifndef GROUP_FILE
+#define GROUP_FILE	"/etc/group"
+#endif
+#ifndef CRED_TTL
+#define CRED_TTL	(15 * 60)	/* default for -C */
+#endif
 
 #ifndef SENDMAIL
 #define SENDMAIL	"/usr/sbin/sendmail"
@@ -96,6 +126,27 @@
 #ifndef FREQ_TAG
 #define FREQ_TAG		"FREQ="
 #endif
+#ifndef SPREAD_TAG
+#define SPREAD_TAG		"SPREAD="
+#endif
+#ifndef MEM_TAG
+#define MEM_TAG			"MEM="
+#endif
+#ifndef CPU_TAG
+#define CPU_TAG			"CPU="
+#endif
+#ifndef IO_TAG
+#define IO_TAG			"IO="
+#endif
+#ifndef TIMEOUT_TAG
+#define TIMEOUT_TAG		"TIMEOUT="
+#endif
+#ifndef OVERLAP_TAG
+#define OVERLAP_TAG		"OVERLAP="
+#endif
+#ifndef TIMEOUT_GRACE
+#define TIMEOUT_GRACE	10		/* seconds from a timed out job's SIGTERM to its SIGKILL */
+#endif
 
 #define HOURLY_FREQ		60 * 60
 #define DAILY_FREQ		24 * HOURLY_FREQ
@@ -109,9 +160,44 @@
 #define FIELD_MONTHS    12
 #define FIELD_W_DAYS     7
 
+#define FIRST_DOW  (1 << 0)
+#define SECOND_DOW (1 << 1)
+#define THIRD_DOW  (1 << 2)
+#define FOURTH_DOW (1 << 3)
+#define FIFTH_DOW  (1 << 4)
+#define LAST_DOW   (1 << 5)
+#define ALL_DOW    (FIRST_DOW|SECOND_DOW|THIRD_DOW|FOURTH_DOW|FIFTH_DOW|LAST_DOW)
+
+/* masks with every value of a field set; cl_Days bit 0 is never matched */
+#define ALL_MINUTES		((((uint64_t)1) << FIELD_MINUTES) - 1)
+#define ALL_HOURS		((((uint32_t)1) << FIELD_HOURS) - 1)
+#define ALL_M_DAYS		((uint32_t)0xffffffff)
+#define ALL_MONTHS		((((uint16_t)1) << FIELD_MONTHS) - 1)
+#define ALL_W_DAYS		((1 << FIELD_W_DAYS) - 1)
+
+/* cl_Dow keeps one byte of FIRST_DOW..LAST_DOW bits per weekday */
+#define DOW_BITS(line, wday)	((char)((line)->cl_Dow >> (8 * (wday))))
+
+#define HASH_INIT		2166136261UL	/* seed for HashString() */
+
 #define JOB_NONE        0
 #define JOB_ARMED       -1
 #define JOB_WAITING     -2
+#define JOB_QUEUED      -3
+
+/* cl_MailFlag */
+#define MAIL_NONE		0
+#define MAIL_FILE		1	/* output goes to a file in TempDir	*/
+#define MAIL_MEMFD		2	/* output goes to the memfd cl_MailFd	*/
+
+/* cl_Overlap: what a run due while the last one is still running does */
+#define OVERLAP_SKIP	0	/* it's dropped			*/
+#define OVERLAP_QUEUE	1	/* it starts when the last one exits; one at most */
+#define OVERLAP_KILL	2	/* the last one is stopped, and it starts then */
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#endif
 
 #define LOGHEADER TIMESTAMP_FMT " %%s " LOG_IDENT ": "
 #define LOCALE_LOGHEADER "%c %%s " LOG_IDENT ": "
@@ -122,20 +208,59 @@
 #define SMALL_BUFFER	256
 #define RW_BUFFER		1024
 #define LOG_BUFFER		2048 	/* max size of log line */
+#ifndef MAXMAILSIZE
+#define MAXMAILSIZE		(1024 * 1024)	/* job output mailed, beyond which it's cut */
+#endif
+#ifndef STAMP_MAXRECS
+#define STAMP_MAXRECS	(256 * 1024)	/* jobs the -k store can hold */
+#endif
+#ifndef PARSE_THREADS
+#define PARSE_THREADS	16		/* most threads crontabs are parsed in at once */
+#endif
+#ifndef SNAPSHOT_DELAY
+#define SNAPSHOT_DELAY	(10 * 60)	/* most seconds a changed -p snapshot waits to be written */
+#endif
+#ifndef STATS_SAMPLES
+#define STATS_SAMPLES	64		/* recent runs of a job its p95 is taken over */
+#endif
+#define SCHED_HORIZON	(9 * 366 * 24 * 60 * 60)	/* how far ahead to look for a job's next run; Feb 29 can be 8 years off */
+
+typedef struct HashNode {
+	struct	HashNode *hn_Next;
+	unsigned long	hn_Hash;
+	void	*hn_Data;
+} HashNode;
+
+typedef struct HashTable {
+	struct	HashNode **ht_Buckets;
+	unsigned long	ht_Mask;	/* bucket count - 1, a power of 2 less 1	*/
+	long	ht_Count;
+} HashTable;
 
 typedef struct CronFile {
     struct CronFile *cf_Next;
+    struct CronFile **cf_PPrev;	/* the pointer that points to us	*/
     struct CronLine *cf_LineBase;
     char	*cf_DPath;	/* Directory path to cronfile */
     char	*cf_FileName;	/* Name of cronfile */
     char	*cf_UserName;	/* username to execute jobs as */
     int		cf_Ready;	/* bool: one or more jobs ready	*/
-    int		cf_Running;	/* bool: one or more jobs running */
+    int		cf_Running;	/* number of jobs running		*/
     int		cf_Deleted;	/* marked for deletion, ignore	*/
+    int		cf_Seen;	/* found by the current SynchronizeDir	*/
+    struct HashNode *cf_UserNode;	/* in FilesByUser, while not deleted	*/
+    struct HashNode *cf_PathNode;	/* in FilesByPath, while not deleted	*/
+    struct HashTable cf_Jobs;	/* named CronLines, by cl_JobName	*/
+    dev_t	cf_Dev;		/* stat signature when parsed, so	*/
+    ino_t	cf_Ino;		/* SynchronizeDir can skip unchanged	*/
+    off_t	cf_Size;	/* files				*/
+    struct timespec cf_Mtime;
+    struct timespec cf_Ctime;
 } CronFile;
 
 typedef struct CronLine {
     struct CronLine *cl_Next;
+    struct CronFile *cl_File;	/* CronFile this line belongs to	*/
     char	*cl_Shell;	/* shell command			*/
 	char	*cl_Description;	/* either "<cl_Shell>" or "job <cl_JobName>" */
 	char	*cl_JobName;	/* job name, if any			*/
@@ -146,14 +271,39 @@ typedef struct CronLine {
 	int		cl_Delay;		/* defaults to cl_Freq or hourly	*/
 	time_t	cl_LastRan;
 	time_t	cl_NotUntil;
-	int		cl_Pid;			/* running pid, 0, or armed (-1), or waiting (-2) */
-    int		cl_MailFlag;	/* running pid is for mail		*/
+	time_t	cl_NextRun;		/* next scheduled minute plus cl_Spread, while queued	*/
+	int		cl_Spread;		/* seconds after each scheduled minute to start	*/
+	int		cl_HeapIdx;		/* position in schedule heap, or 0	*/
+	int		cl_Visit;		/* ResolveWaiters' cycle search state	*/
+	int		cl_Pid;			/* running pid, 0, or armed (-1), waiting (-2) or queued (-3) */
+	struct	CronLine *cl_QNext;		/* JobQueue links, while queued	*/
+	struct	CronLine **cl_QPPrev;
+	time_t	cl_Queued;		/* when it joined JobQueue	*/
+	char	*cl_Cgroup;		/* running job's cgroup, with -g	*/
+	int64_t	cl_MemMax;		/* MEM=, in bytes, or 0		*/
+	int		cl_CpuWeight;	/* CPU=, or 0			*/
+	int		cl_IoWeight;	/* IO=, or 0			*/
+	int		cl_Timeout;		/* TIMEOUT=, in seconds, or 0	*/
+	time_t	cl_Deadline;	/* when to signal the running job next, or 0 */
+	int		cl_Killed;		/* last signal sent it to stop it, or 0 */
+	short	cl_Overlap;		/* OVERLAP=, as OVERLAP_*		*/
+	short	cl_Pending;		/* a run is due once it exits	*/
+	time_t	cl_PendT1;		/* and the ArmJob() window it came due in */
+	time_t	cl_PendT2;
+	unsigned long cl_Skipped;	/* runs dropped as it was still running */
+	unsigned long cl_Deferred;	/* runs made to wait for it to exit */
+    int		cl_MailFlag;	/* where job output goes: MAIL_*	*/
+    int		cl_MailFd;	/* with MAIL_MEMFD, or while cl_OutFd is open, else -1 */
     int		cl_MailPos;	/* 'empty file' size			*/
-    char	cl_Mins[FIELD_MINUTES];	/* 0-59				*/
-    char	cl_Hrs[FIELD_HOURS];	/* 0-23					*/
-    char	cl_Days[FIELD_M_DAYS];	/* 1-31					*/
-    char	cl_Mons[FIELD_MONTHS];	/* 0-11				*/
-    char	cl_Dow[FIELD_W_DAYS];	/* 0-6, beginning sunday		*/
+    int		cl_OutFd;	/* pipe the running job writes to, or -1	*/
+    off_t	cl_OutSize;	/* bytes read from it, kept or not	*/
+	struct	timespec cl_Started;	/* CLOCK_MONOTONIC, while running	*/
+	struct	JobStats *cl_Stats;		/* what its runs used, or NULL; see stats.c */
+    uint64_t	cl_Mins;	/* bits 0-59				*/
+    uint64_t	cl_Dow;		/* bytes 0-6, beginning sunday; see DOW_BITS	*/
+    uint32_t	cl_Hrs;		/* bits 0-23				*/
+    uint32_t	cl_Days;	/* bits 1-31				*/
+    uint16_t	cl_Mons;	/* bits 0-11				*/
 } CronLine;
 
 typedef struct CronWaiter {
@@ -162,6 +312,7 @@ typedef struct CronWaiter {
 	struct	CronLine *cw_NotifLine;
 	short	cw_Flag;
 	int		cw_MaxWait;
+	char	*cw_Name;		/* AFTER= name, until ResolveWaiters	*/
 } CronWaiter;
 
 typedef struct CronNotifier {
@@ -169,5 +320,15 @@ typedef struct CronNotifier {
 	struct	CronWaiter *cn_Waiter;
 } CronNotifier;
 
+typedef struct KnownStamp {
+	char	*ks_Path;		/* the job's cl_Timestamp */
+	struct	HashNode *ks_Node;	/* in KnownStamps */
+	time_t	ks_LastRan;		/* as stamped; 0 for just "after ks_NotUntil" */
+	time_t	ks_NotUntil;
+	ino_t	ks_Ino;			/* the text stamp as we last read or wrote it, */
+	off_t	ks_Size;		/* or 0 while there's none */
+	struct timespec ks_Mtime;
+} KnownStamp;
+
 #include "protos.h"
 
@@ -0,0 +1,204 @@
+/*
+ * DIGEST.C
+ *
+ * With -D, job output isn't mailed as each job ends.  It's collected per
+ * user, and once the first of it is DigestWindow seconds old, mailed as
+ * one MIME multipart message with a part for each job.  A digest is sent
+ * early rather than grow past MAXMAILSIZE, and each part is cut to that
+ * size, as a job's own mail is.  Each digest has a boundary of its own,
+ * made from random bytes, so job output can't guess it to split the message.
+ *
+ * May be distributed under the GNU General Public License version 2 or any later version.
+ */
+
+#include <sys/random.h>
+
+#include "defs.h"
+
+Prototype int DigestOutput(CronFile *file, CronLine *line, int mailFd, int exit_status);
+Prototype void FlushDigests(time_t t);
+Prototype time_t NextDigestTime(void);
+
+
+typedef struct Digest {
+	struct Digest *dg_Next;
+	char	*dg_User;
+	int		dg_Fd;			/* memfd holding the parts so far */
+	int		dg_Parts;
+	off_t	dg_Size;		/* bytes in dg_Fd */
+	char	dg_Boundary[64];	/* "=-cron-digest-", 32 hex digits, "-=" */
+	time_t	dg_Due;			/* when to send it */
+	HashNode *dg_Node;		/* in DigestsByUser */
+} Digest;
+
+Digest *NewDigest(const char *user, unsigned long hash);
+void FlushDigest(Digest *dg);
+void SendDigest(Digest *dg);
+
+Digest *Digests = NULL;		/* oldest first, so by dg_Due */
+Digest **DigestTail = &Digests;
+HashTable DigestsByUser;	/* the same Digests, by dg_User */
+
+/*
+ * DigestOutput() - add line's output in mailFd, after its headers, to
+ * its user's digest
+ *
+ * Returns 1 if it was taken, or 0 if it should be mailed now, as without
+ * -D.  The caller still closes mailFd.
+ */
+int
+DigestOutput(CronFile *file, CronLine *line, int mailFd, int exit_status)
+{
+	unsigned long hash = HashString(HASH_INIT, file->cf_UserName);
+	char buf[RW_BUFFER];
+	Digest *dg = NULL;
+	HashNode *hn;
+	struct stat sbuf;
+	off_t size, left;
+	ssize_t n;
+
+	if (DigestWindow <= 0)
+		return(0);
+	if (fstat(mailFd, &sbuf) < 0)
+		return(0);
+	/* EndJob has cut the output to MAXMAILSIZE, and noted it; in case not */
+	size = sbuf.st_size - line->cl_MailPos;
+	if (size > MAXMAILSIZE + SMALL_BUFFER)
+		size = MAXMAILSIZE + SMALL_BUFFER;
+
+	for (hn = HashFirst(&DigestsByUser, hash); hn; hn = HashNext(hn)) {
+		dg = hn->hn_Data;
+		if (strcmp(dg->dg_User, file->cf_UserName) == 0)
+			break;
+	}
+	if (hn && dg->dg_Parts &&
+			dg->dg_Size + size + 2 * strlen(line->cl_Description) + SMALL_BUFFER > MAXMAILSIZE) {
+		/* it would be too big: send what it has, and start another */
+		if (DebugOpt)
+			printlogf(LOG_DEBUG, "digest for user %s is full, sending it early\n", dg->dg_User);
+		FlushDigest(dg);
+		hn = NULL;
+	}
+	if (!hn && (dg = NewDigest(file->cf_UserName, hash)) == NULL)
+		return(0);
+
+	fdprintf(dg->dg_Fd, "--%s\nContent-Type: text/plain\nContent-Description: %s\n\n",
+			dg->dg_Boundary, line->cl_Description);
+	fdprintf(dg->dg_Fd, "%s (exit status %d)\n\n", line->cl_Description, exit_status);
+	lseek(mailFd, line->cl_MailPos, SEEK_SET);
+	for (left = size; left > 0 && (n = read(mailFd, buf, (left < sizeof(buf)) ? left : sizeof(buf))) > 0; left -= n)
+		write(dg->dg_Fd, buf, n);
+	write(dg->dg_Fd, "\n", 1);
+	dg->dg_Size = lseek(dg->dg_Fd, 0, SEEK_CUR);
+	++dg->dg_Parts;
+
+	if (DebugOpt)
+		printlogf(LOG_DEBUG, "added output to digest for user %s (%d parts): %s\n",
+				dg->dg_User, dg->dg_Parts, line->cl_Description);
+	return(1);
+}
+
+/*
+ * FlushDigests() - send the digests due by t; all of them if t is -1
+ */
+void
+FlushDigests(time_t t)
+{
+	Digest *dg;
+
+	while ((dg = Digests) != NULL && (t == (time_t)-1 || dg->dg_Due <= t))
+		FlushDigest(dg);
+}
+
+/*
+ * FlushDigest() - send dg now, and forget it
+ */
+void
+FlushDigest(Digest *dg)
+{
+	Digest **pdg;
+
+	for (pdg = &Digests; *pdg != dg; pdg = &(*pdg)->dg_Next)
+		;
+	if ((*pdg = dg->dg_Next) == NULL)
+		DigestTail = pdg;
+	HashDel(&DigestsByUser, dg->dg_Node);
+	SendDigest(dg);
+	close(dg->dg_Fd);
+	free(dg->dg_User);
+	free(dg);
+}
+
+/*
+ * NewDigest() - start a digest for user, due DigestWindow from now; NULL
+ * if there's nowhere to keep it
+ */
+Digest *
+NewDigest(const char *user, unsigned long hash)
+{
+	unsigned char rnd[16];
+	unsigned long seed;
+	struct timespec ts;
+	Digest *dg;
+	int fd;
+	int i;
+
+	if ((fd = OutputFd()) < 0)
+		return(NULL);
+	if (!(dg = malloc(sizeof(Digest))) || !(dg->dg_User = strdup(user))) {
+		errno = ENOMEM;
+		perror("NewDigest");
+		exit(1);
+	}
+	if (getrandom(rnd, sizeof(rnd), GRND_NONBLOCK) != sizeof(rnd)) {
+		/* not seeded yet, early in boot; hard enough to guess for this */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		seed = HashInt(ts.tv_sec ^ ts.tv_nsec ^ (unsigned long)user);
+		for (i = 0; i < sizeof(rnd); ++i) {
+			seed = HashInt(seed + i);
+			rnd[i] = seed;
+		}
+	}
+	strcpy(dg->dg_Boundary, "=-cron-digest-");
+	for (i = 0; i < sizeof(rnd); ++i)
+		sprintf(dg->dg_Boundary + 14 + 2 * i, "%02x", rnd[i]);
+	strcat(dg->dg_Boundary, "-=");
+
+	dg->dg_Fd = fd;
+	dg->dg_Parts = 0;
+	dg->dg_Due = time(NULL) + DigestWindow;
+	dg->dg_Next = NULL;
+	dg->dg_Node = HashAdd(&DigestsByUser, hash, dg);
+	*DigestTail = dg;
+	DigestTail = &dg->dg_Next;
+	fdprintf(fd, "To: %s\nSubject: cron for user %s: digest\n"
+			"MIME-Version: 1.0\nContent-Type: multipart/mixed; boundary=\"%s\"\n\n",
+			Mailto ? Mailto : dg->dg_User,
+			dg->dg_User,
+			dg->dg_Boundary
+			);
+	dg->dg_Size = lseek(fd, 0, SEEK_CUR);
+	return(dg);
+}
+
+/*
+ * NextDigestTime() - when the oldest digest is due, or -1 if there are none
+ */
+time_t
+NextDigestTime(void)
+{
+	return(Digests ? Digests->dg_Due : (time_t)-1);
+}
+
+/*
+ * SendDigest() - close off dg's parts, and mail it
+ */
+void
+SendDigest(Digest *dg)
+{
+	fdprintf(dg->dg_Fd, "--%s--\n", dg->dg_Boundary);
+	lseek(dg->dg_Fd, 0, SEEK_SET);
+	if (DebugOpt)
+		printlogf(LOG_DEBUG, "sending digest for user %s (%d parts)\n", dg->dg_User, dg->dg_Parts);
+	MailOutput(dg->dg_User, "digest", dg->dg_Fd);
+}
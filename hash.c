@@ -0,0 +1,158 @@
+/*
+ * HASH.C
+ *
+ * A small chained hash table.  Tables don't know what their entries are
+ * keyed on: callers hash the key themselves, and check candidate entries
+ * with HashFirst()/HashNext(), which return the nodes whose hash matches.
+ *
+ * May be distributed under the GNU General Public License version 2 or any later version.
+ */
+
+#include "defs.h"
+
+Prototype unsigned long HashString(unsigned long hash, const char *str);
+Prototype unsigned long HashInt(unsigned long val);
+Prototype HashNode *HashAdd(HashTable *ht, unsigned long hash, void *data);
+Prototype void HashDel(HashTable *ht, HashNode *hn);
+Prototype HashNode *HashFirst(HashTable *ht, unsigned long hash);
+Prototype HashNode *HashNext(HashNode *hn);
+Prototype void HashFree(HashTable *ht);
+
+void HashGrow(HashTable *ht);
+
+/*
+ * HashString() - FNV-1a
+ *
+ * Start with HASH_INIT; pass the result back in to hash several strings
+ * as one key.
+ */
+unsigned long
+HashString(unsigned long hash, const char *str)
+{
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619UL;
+	}
+	/* keep "ab","c" and "a","bc" apart */
+	hash ^= 0xff;
+	hash *= 16777619UL;
+	return(hash);
+}
+
+unsigned long
+HashInt(unsigned long val)
+{
+	val ^= val >> 16;
+	val *= 0x45d9f3bUL;
+	val ^= val >> 16;
+	return(val);
+}
+
+HashNode *
+HashAdd(HashTable *ht, unsigned long hash, void *data)
+{
+	HashNode *hn;
+	HashNode **bucket;
+
+	if (ht->ht_Count >= (long)ht->ht_Mask)
+		HashGrow(ht);
+	if (!(hn = malloc(sizeof(HashNode)))) {
+		errno = ENOMEM;
+		perror("HashAdd");
+		exit(1);
+	}
+	bucket = &ht->ht_Buckets[hash & ht->ht_Mask];
+	hn->hn_Next = *bucket;
+	hn->hn_Hash = hash;
+	hn->hn_Data = data;
+	*bucket = hn;
+	++ht->ht_Count;
+	return(hn);
+}
+
+void
+HashDel(HashTable *ht, HashNode *hn)
+{
+	HashNode **phn = &ht->ht_Buckets[hn->hn_Hash & ht->ht_Mask];
+
+	while (*phn != hn)
+		phn = &(*phn)->hn_Next;
+	*phn = hn->hn_Next;
+	--ht->ht_Count;
+	free(hn);
+}
+
+HashNode *
+HashFirst(HashTable *ht, unsigned long hash)
+{
+	HashNode *hn;
+
+	if (ht->ht_Count == 0)
+		return(NULL);
+	hn = ht->ht_Buckets[hash & ht->ht_Mask];
+	while (hn && hn->hn_Hash != hash)
+		hn = hn->hn_Next;
+	return(hn);
+}
+
+HashNode *
+HashNext(HashNode *hn)
+{
+	unsigned long hash = hn->hn_Hash;
+
+	hn = hn->hn_Next;
+	while (hn && hn->hn_Hash != hash)
+		hn = hn->hn_Next;
+	return(hn);
+}
+
+/*
+ * HashFree() - drop every node, leaving an empty table
+ *
+ * The data the nodes point to is the caller's business.
+ */
+void
+HashFree(HashTable *ht)
+{
+	unsigned long i;
+	HashNode *hn;
+
+	for (i = 0; ht->ht_Buckets && i <= ht->ht_Mask; ++i) {
+		while ((hn = ht->ht_Buckets[i]) != NULL) {
+			ht->ht_Buckets[i] = hn->hn_Next;
+			free(hn);
+		}
+	}
+	free(ht->ht_Buckets);
+	ht->ht_Buckets = NULL;
+	ht->ht_Mask = 0;
+	ht->ht_Count = 0;
+}
+
+/*
+ * HashGrow() - double the bucket array, keeping about one node per bucket
+ */
+void
+HashGrow(HashTable *ht)
+{
+	unsigned long n = ht->ht_Buckets ? (ht->ht_Mask + 1) * 2 : 16;
+	unsigned long i;
+	HashNode **buckets;
+	HashNode *hn;
+
+	if (!(buckets = calloc(n, sizeof(HashNode *)))) {
+		errno = ENOMEM;
+		perror("HashGrow");
+		exit(1);
+	}
+	for (i = 0; ht->ht_Buckets && i <= ht->ht_Mask; ++i) {
+		while ((hn = ht->ht_Buckets[i]) != NULL) {
+			ht->ht_Buckets[i] = hn->hn_Next;
+			hn->hn_Next = buckets[hn->hn_Hash & (n - 1)];
+			buckets[hn->hn_Hash & (n - 1)] = hn;
+		}
+	}
+	free(ht->ht_Buckets);
+	ht->ht_Buckets = buckets;
+	ht->ht_Mask = n - 1;
+}
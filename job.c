@@ -12,28 +12,50 @@
 Prototype void RunJob(CronFile *file, CronLine *line);
 Prototype void EndJob(CronFile *file, CronLine *line, int exit_status);
 
+Prototype void MailOutput(const char *user, const char *desc, int mailFd);
+Prototype int OutputFd(void);
+Prototype int OutputPoll(void);
+Prototype void CollectOutput(void);
 Prototype const char *SendMail;
 
+void DrainOutput(CronLine *line, off_t limit, int ended);
+
+int OutputEp = -1;		/* epoll set of the running jobs' cl_OutFd */
+
 void
 RunJob(CronFile *file, CronLine *line)
 {
 	char mailFile[SMALL_BUFFER];
+	char *argv[4];
+	const char *failed;
 	int mailFd;
+	int outFd[2] = { -1, -1 };
+	int cgfd;
 	const char *value = Mailto;
+	struct epoll_event ev;
 
 	line->cl_Pid = 0;
-	line->cl_MailFlag = 0;
+	line->cl_MailFlag = MAIL_NONE;
+	line->cl_MailFd = -1;
+	line->cl_OutFd = -1;
+	line->cl_OutSize = 0;
 
 	/*
-	 * try to open mail output file - owner root so nobody can screw with it.
+	 * Job output is collected in a memfd of ours, so a job with nothing to
+	 * say costs no files.  Where there's no memfd_create, fall back to a
+	 * mail output file - owner root so nobody can screw with it.
 	 */
 
 	snprintf(mailFile, sizeof(mailFile), TempFileFmt,
 			file->cf_UserName, (int)getpid());
 
-	if ((mailFd = open(mailFile, O_CREAT|O_TRUNC|O_WRONLY|O_EXCL|O_APPEND, 0600)) >= 0) {
-		/* success: write headers to mailFile */
-		line->cl_MailFlag = 1;
+	if ((mailFd = OutputFd()) >= 0) {
+		line->cl_MailFlag = MAIL_MEMFD;
+	} else if ((mailFd = open(mailFile, O_CREAT|O_TRUNC|O_WRONLY|O_EXCL|O_APPEND|O_CLOEXEC, 0600)) >= 0) {
+		line->cl_MailFlag = MAIL_FILE;
+	}
+	if (mailFd >= 0) {
+		/* success: write headers */
 		/* if we didn't specify a -m Mailto, use the local user */
 		if (!value)
 			value = file->cf_UserName;
@@ -42,8 +64,27 @@ RunJob(CronFile *file, CronLine *line)
 				file->cf_UserName,
 				line->cl_Description
 				);
-		/* remember mailFile's size */
+		/* remember the headers' size */
 		line->cl_MailPos = lseek(mailFd, 0, 1);
+
+		/*
+		 * The job writes to a pipe that we drain into mailFd as it runs,
+		 * so what's past MAXMAILSIZE is thrown away as it comes.  If
+		 * there's no pipe to be had, it writes to mailFd itself, and
+		 * EndJob cuts it.
+		 */
+		ev.events = EPOLLIN;
+		ev.data.ptr = line;
+		if (OutputPoll() >= 0 && pipe(outFd) == 0) {
+			if (fcntl(outFd[0], F_SETFD, FD_CLOEXEC) < 0 ||
+					fcntl(outFd[1], F_SETFD, FD_CLOEXEC) < 0 ||
+					fcntl(outFd[0], F_SETFL, O_NONBLOCK) < 0 ||
+					epoll_ctl(OutputEp, EPOLL_CTL_ADD, outFd[0], &ev) < 0) {
+				close(outFd[0]);
+				close(outFd[1]);
+				outFd[0] = outFd[1] = -1;
+			}
+		}
 	}
 	/*
 	 * else no mailFd, we complain later and don't check job output
@@ -52,76 +93,31 @@ RunJob(CronFile *file, CronLine *line)
 
 
 	/*
-	 * Fork as the user in question and run program
+	 * Run the program as the user in question: stdin is already /dev/null,
+	 * stdout and stderr go to mailFile, or without one to /dev/null
 	 */
 
-	if ((line->cl_Pid = fork()) == 0) {
-		/*
-		 * CHILD, FORK OK, PRE-EXEC
-		 *
-		 * Change running state to the user in question
-		 */
-
-		if (ChangeUser(file->cf_UserName, TempDir) < 0) {
-			printlogf(LOG_ERR, "unable to ChangeUser (user %s %s)\n",
-					file->cf_UserName,
-					line->cl_Description
-					);
-			exit(0);
-		}
-
-		/* from this point we are unpriviledged */
-
-		if (DebugOpt)
-			printlogf(LOG_DEBUG, "child running: %s\n", line->cl_Description);
-
-		/*
-		 * Inside child, we copy our fd 2 (which may be /dev/null) into
-		 * an open-until-exec fd 8
-		 */
-		dup2(2, 8);
-		fcntl(8, F_SETFD, FD_CLOEXEC);
-		fclose(stderr);
-
-		if (mailFd >= 0) {
-			/* stdin is already /dev/null, setup stdout and stderr > mailFile */
-			dup2(mailFd, 1);
-			dup2(mailFd, 2);
-			close(mailFd);
-		} else {
-			/* complain about no mailFd to log (now associated with fd 8) */
-			fdprintlogf(LOG_WARNING, 8, "unable to create mail file %s: cron output for user %s %s to /dev/null\n",
-					mailFile,
-					file->cf_UserName,
-					line->cl_Description
-				   );
-			/* stderr > /dev/null */
-			dup2(1, 2);
-		}
-
-		/*
-		 * Start a new process group, so that children still in the crond's process group
-		 * are all mailjobs.
-		 */
-		setpgid(0, 0);
-
-		execl("/bin/sh", "/bin/sh", "-c", line->cl_Shell, NULL);
-		/*
-		 * CHILD FAILED TO EXEC CRONJOB
-		 *
-		 * Complain to our log (now associated with fd 8)
-		 */
-		fdprintlogf(LOG_ERR, 8, "unable to exec (user %s cmd /bin/sh -c %s)\n",
+	if (mailFd < 0)
+		printlogf(LOG_WARNING, "unable to create mail file %s: cron output for user %s %s to /dev/null\n",
+				mailFile,
 				file->cf_UserName,
-				line->cl_Shell
+				line->cl_Description
 			   );
-		/*
-		 * Also complain to stdout, which will be either the mailFile or /dev/null
-		 */
-		fdprintf(1, "unable to exec: /bin/sh -c %s\n", line->cl_Shell);
-		exit(0);
-
-	} else if (line->cl_Pid < 0) {
+	argv[0] = "/bin/sh";
+	argv[1] = "-c";
+	argv[2] = line->cl_Shell;
+	argv[3] = NULL;
+	cgfd = CgroupCreate(file, line);
+	if (outFd[1] >= 0)
+		line->cl_Pid = Launch(file->cf_UserName, argv, -1, outFd[1], outFd[1], cgfd, &failed);
+	else
+		line->cl_Pid = Launch(file->cf_UserName, argv, -1, (mailFd >= 0) ? mailFd : -1, (mailFd >= 0) ? mailFd : 1, cgfd, &failed);
+	if (cgfd >= 0)
+		close(cgfd);
+	if (outFd[1] >= 0)
+		close(outFd[1]);
+
+	if (line->cl_Pid < 0) {
 		/*
 		 * PARENT, FORK FAILED
 		 *
@@ -132,7 +128,14 @@ RunJob(CronFile *file, CronLine *line)
 				line->cl_Description
 				);
 		line->cl_Pid = 0;
-		remove(mailFile);
+		if (outFd[0] >= 0) {
+			epoll_ctl(OutputEp, EPOLL_CTL_DEL, outFd[0], NULL);
+			close(outFd[0]);
+		}
+		if (line->cl_MailFlag == MAIL_FILE)
+			remove(mailFile);
+		line->cl_MailFlag = MAIL_NONE;
+		CgroupEnd(file, line);
 
 	} else {
 		/*
@@ -142,9 +145,48 @@ RunJob(CronFile *file, CronLine *line)
 		 */
 		char mailFile2[SMALL_BUFFER];
 
+		if (failed) {
+			/*
+			 * CHILD FAILED TO CHANGE USER OR EXEC CRONJOB
+			 *
+			 * It has already exited; complain to our log, and to the mailFile
+			 */
+			if (strcmp(failed, "exec") == 0) {
+				printlogf(LOG_ERR, "unable to exec (user %s cmd /bin/sh -c %s): %s\n",
+						file->cf_UserName,
+						line->cl_Shell,
+						strerror(errno)
+					   );
+				if (mailFd >= 0)
+					fdprintf(mailFd, "unable to exec: /bin/sh -c %s\n", line->cl_Shell);
+			} else {
+				printlogf(LOG_ERR, "unable to ChangeUser (user %s %s): %s: %s\n",
+						file->cf_UserName,
+						line->cl_Description,
+						failed,
+						strerror(errno)
+						);
+			}
+		}
+
+		StartStats(line);
+		if (line->cl_Timeout || JobTimeout)
+			line->cl_Deadline = time(NULL) + (line->cl_Timeout ? line->cl_Timeout : JobTimeout);
+
+		line->cl_OutFd = outFd[0];
+		if (line->cl_MailFlag == MAIL_MEMFD) {
+			/* the memfd is all there is of the output; keep it until EndJob */
+			line->cl_MailFd = mailFd;
+			return;
+		}
 		snprintf(mailFile2, sizeof(mailFile2), TempFileFmt,
 				file->cf_UserName, line->cl_Pid);
 		rename(mailFile, mailFile2);
+		if (outFd[0] >= 0) {
+			/* we copy its output into mailFile while it runs */
+			line->cl_MailFd = mailFd;
+			return;
+		}
 	}
 
 	/*
@@ -156,6 +198,79 @@ RunJob(CronFile *file, CronLine *line)
 		close(mailFd);
 }
 
+/*
+ * OutputFd() - a new memfd for a job's output, or -1
+ */
+int
+OutputFd(void)
+{
+#ifdef SYS_memfd_create
+	return(syscall(SYS_memfd_create, "cron output", MFD_CLOEXEC));
+#else
+	errno = ENOSYS;
+	return(-1);
+#endif
+}
+
+/*
+ * OutputPoll() - the epoll descriptor the running jobs' output pipes are
+ * watched on, made the first time, or -1
+ */
+int
+OutputPoll(void)
+{
+	if (OutputEp < 0)
+		OutputEp = epoll_create1(EPOLL_CLOEXEC);
+	return(OutputEp);
+}
+
+/*
+ * CollectOutput() - copy what the running jobs have written since we last
+ * looked
+ *
+ * No job gets more than a few pipefuls each time round, so one that floods
+ * its output can't keep us from the others, or from the rest of the loop.
+ */
+void
+CollectOutput(void)
+{
+	struct epoll_event evs[32];
+	int n;
+	int i;
+
+	if ((n = epoll_wait(OutputEp, evs, arysize(evs), 0)) <= 0)
+		return;
+	for (i = 0; i < n; ++i)
+		DrainOutput(evs[i].data.ptr, 4 * 65536, 0);
+}
+
+/*
+ * DrainOutput() - read up to about limit bytes from line's cl_OutFd into
+ * cl_MailFd, keeping only the first MAXMAILSIZE it ever wrote
+ *
+ * The pipe is closed once the job and whatever it left running have all
+ * closed it, or, if the job has ended, when we're done here.
+ */
+void
+DrainOutput(CronLine *line, off_t limit, int ended)
+{
+	char buf[4096];
+	ssize_t n = -1;
+	off_t left;
+
+	while (limit > 0 && (n = read(line->cl_OutFd, buf, sizeof(buf))) > 0) {
+		limit -= n;
+		if ((left = MAXMAILSIZE - line->cl_OutSize) > 0)
+			write(line->cl_MailFd, buf, (n < left) ? n : left);
+		line->cl_OutSize += n;
+	}
+	if (ended || n == 0 || (n < 0 && errno != EAGAIN)) {
+		epoll_ctl(OutputEp, EPOLL_CTL_DEL, line->cl_OutFd, NULL);
+		close(line->cl_OutFd);
+		line->cl_OutFd = -1;
+	}
+}
+
 /*
  * EndJob - called when main job terminates
  */
@@ -176,6 +291,8 @@ EndJob(CronFile *file, CronLine *line, int exit_status)
 		return;
 	}
 
+	/* log what its cgroup used, and kill anything it left behind */
+	CgroupEnd(file, line);
 
 	/*
 	 * check return status
@@ -194,25 +311,17 @@ EndJob(CronFile *file, CronLine *line, int exit_status)
 			 * process finished without returning EAGAIN (it may have returned some other error)
 			 * mark as having run and update timestamp
 			 */
-			FILE *fi;
-			char buf[SMALL_BUFFER];
-			int succeeded = 0;
 			/*
 			 * we base off the time the job was scheduled/started waiting, not the time it finished
 			 *
 			 * line->cl_LastRan = time(NULL);	// use this to base off time finished
 			 */
 			line->cl_LastRan = line->cl_NotUntil - line->cl_Delay;
-			if ((fi = fopen(line->cl_Timestamp, "w")) != NULL) {
-				if (strftime(buf, sizeof(buf), CRONSTAMP_FMT, localtime(&line->cl_LastRan)))
-					if (fputs(buf, fi) >= 0)
-						succeeded = 1;
-				fclose(fi);
-			}
-			if (!succeeded)
-				printlogf(LOG_WARNING, "unable to write timestamp to %s (user %s %s)\n", line->cl_Timestamp, file->cf_UserName, line->cl_Description);
 			line->cl_NotUntil = line->cl_LastRan;
 			line->cl_NotUntil += (line->cl_Freq > 0) ? line->cl_Freq : line->cl_Delay;
+			WriteTimestamp(file, line, exit_status);
+			if (!file->cf_Deleted)
+				ScheduleLine(line, SchedTime);
 		}
 	}
 
@@ -224,6 +333,7 @@ EndJob(CronFile *file, CronLine *line, int exit_status)
 		while (notif) {
 			if (notif->cn_Waiter) {
 				notif->cn_Waiter->cw_Flag = exit_status;
+				WaitersChanged = 1;
 			}
 			notif = notif->cn_Next;
 		}
@@ -249,32 +359,40 @@ EndJob(CronFile *file, CronLine *line, int exit_status)
 					);
 
 
-	if (line->cl_MailFlag != 1) {
+	if (line->cl_OutFd >= 0)
+		/* what it wrote before it exited may still be in the pipe */
+		DrainOutput(line, MAXMAILSIZE, 1);
+
+	if (line->cl_MailFlag == MAIL_NONE) {
 		/* End of job and no mail file */
 		line->cl_Pid = 0;
 		return;
 	}
 
-	/*
-	 * Calculate mailFile's name before clearing cl_Pid
-	 */
-	snprintf(mailFile, sizeof(mailFile), TempFileFmt,
-			file->cf_UserName, line->cl_Pid);
+	if (line->cl_MailFlag == MAIL_MEMFD) {
+		mailFd = line->cl_MailFd;
+	} else {
+		/*
+		 * Calculate mailFile's name before clearing cl_Pid
+		 */
+		snprintf(mailFile, sizeof(mailFile), TempFileFmt,
+				file->cf_UserName, line->cl_Pid);
+		mailFd = open(mailFile, O_RDWR|O_CLOEXEC);
+		remove(mailFile);
+		if (line->cl_MailFd >= 0)
+			close(line->cl_MailFd);
+	}
 	line->cl_Pid = 0;
-
-	line->cl_MailFlag = 0;
-
-	/*
-	 * Check mail file. If size has increased and
-	 * the file is still valid, we sendmail it.
-	 */
-
-	mailFd = open(mailFile, O_RDONLY);
-	remove(mailFile);
+	line->cl_MailFlag = MAIL_NONE;
 	if (mailFd < 0) {
 		return;
 	}
 
+	/*
+	 * Check the output. If it has grown past the headers and, for a
+	 * mail file, the file is still valid, we sendmail it.
+	 */
+
 	/* Was mailFile tampered with, or didn't grow? */
 
 	if (fstat(mailFd, &sbuf) < 0 ||
@@ -287,96 +405,90 @@ EndJob(CronFile *file, CronLine *line, int exit_status)
 		return;
 	}
 
-	if ((line->cl_Pid = fork()) == 0) {
-		/*
-		 * CHILD, FORK OK, PRE-EXEC
-		 *
-		 * Change user id - no way in hell security can be compromised
-		 * by the mailing and we already verified the mail file.
-		 */
-
-		if (ChangeUser(file->cf_UserName, TempDir) < 0) {
-			printlogf(LOG_ERR, "unable to ChangeUser to send mail (user %s %s)\n",
-					file->cf_UserName,
-					line->cl_Description
-					);
-			exit(0);
-		}
-
-		/* from this point we are unpriviledged */
-
-		/*
-		 * Inside child, we copy our fd 2 (which may be /dev/null) into
-		 * an open-until-exec fd 8
-		 */
-
-		dup2(2, 8);
-		fcntl(8, F_SETFD, FD_CLOEXEC);
-		fclose(stderr);
-
-		/*
-		 * Run sendmail with stdin < mailFile and stderr > /dev/null
-		 */
+	/* through a pipe, what's past MAXMAILSIZE was never kept */
+	if (line->cl_OutSize < sbuf.st_size - line->cl_MailPos)
+		line->cl_OutSize = sbuf.st_size - line->cl_MailPos;
+	if (line->cl_OutSize > MAXMAILSIZE) {
+		char buf[SMALL_BUFFER];
 
-		dup2(mailFd, 0);
-		dup2(1, 2);
-		close(mailFd);
+		snprintf(buf, sizeof(buf), "\n[%lld bytes of output, cut to %d]\n",
+				(long long)line->cl_OutSize, MAXMAILSIZE);
+		if (ftruncate(mailFd, line->cl_MailPos + MAXMAILSIZE) == 0)
+			pwrite(mailFd, buf, strlen(buf), line->cl_MailPos + MAXMAILSIZE);
+	}
+	/* with -D, it waits to go out with the user's other output */
+	if (!DigestOutput(file, line, mailFd, exit_status)) {
+		lseek(mailFd, 0, SEEK_SET);
+		MailOutput(file->cf_UserName, line->cl_Description, mailFd);
+	}
 
-		if (!SendMail) {
-			/*
-			 * If using standard sendmail, note in our log (now associated with fd 8)
-			 * that we're trying to mail output
-			 */
-			fdprintlogf(LOG_INFO, 8, "mailing cron output for user %s %s\n",
-					file->cf_UserName,
-					line->cl_Description
-				 );
-			execl(SENDMAIL, SENDMAIL, SENDMAIL_ARGS, NULL);
+	close(mailFd);
 
-			/* exec failed: pass through and log the error */
-			SendMail = SENDMAIL;
+}
 
-		} else {
-			/*
-			 * If using custom mailer script, just try to exec it
-			 */
-			execl(SendMail, SendMail, NULL);
-		}
+/*
+ * MailOutput() - run sendmail as user, with stdin < mailFd, which holds
+ * the mail with its headers; desc says what it's for, in the log
+ *
+ * No way in hell security can be compromised by the mailing and we
+ * already verified the mail file.
+ */
+void
+MailOutput(const char *user, const char *desc, int mailFd)
+{
+	static const char *args[] = { SENDMAIL_ARGS };
+	char *argv[arysize(args) + 2];
+	const char *failed;
+	int i;
 
-		/*
-		 * CHILD FAILED TO EXEC SENDMAIL
-		 *
-		 * Complain to our log (now associated with fd 8)
-		 */
+	/*
+	 * Run sendmail with stdin < mailFile and stderr > /dev/null
+	 */
 
-		fdprintlogf(LOG_WARNING, 8, "unable to exec %s: cron output for user %s %s to /dev/null\n",
-				SendMail,
-				file->cf_UserName,
-				line->cl_Description
-			   );
-		exit(0);
+	if (SendMail) {
+		argv[0] = (char *)SendMail;
+		argv[1] = NULL;
+	} else {
+		/* note in our log that we're trying to mail output */
+		printlogf(LOG_INFO, "mailing cron output for user %s %s\n",
+				user,
+				desc
+			 );
+		argv[0] = SENDMAIL;
+		for (i = 0; i < arysize(args); ++i)
+			argv[i + 1] = (char *)args[i];
+		argv[i + 1] = NULL;
+	}
 
-	} else if (line->cl_Pid < 0) {
+	if (Launch(user, argv, mailFd, -1, 1, -1, &failed) < 0) {
 		/*
 		 * PARENT, FORK FAILED
 		 *
 		 * Complain to our log (with regular fd 2)
 		 */
 		printlogf(LOG_WARNING, "unable to fork: cron output for user %s %s to /dev/null\n",
-				file->cf_UserName,
-				line->cl_Description
+				user,
+				desc
 			);
-		line->cl_Pid = 0;
-	} else {
+	} else if (failed) {
 		/*
-		 * PARENT, FORK OK
+		 * CHILD FAILED TO CHANGE USER OR EXEC SENDMAIL
 		 *
-		 * We clear cl_Pid even when mailjob successfully forked
-		 * and catch the dead mailjobs with our SIGCHLD handler.
+		 * It has already exited; ReapJobs reaps it and finds no line for it,
+		 * as it does a mailjob that ran.
 		 */
-		line->cl_Pid = 0;
+		if (strcmp(failed, "exec") == 0)
+			printlogf(LOG_WARNING, "unable to exec %s: cron output for user %s %s to /dev/null\n",
+					argv[0],
+					user,
+					desc
+				   );
+		else
+			printlogf(LOG_ERR, "unable to ChangeUser to send mail (user %s %s): %s: %s\n",
+					user,
+					desc,
+					failed,
+					strerror(errno)
+					);
 	}
-
-	close(mailFd);
-
 }
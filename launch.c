@@ -0,0 +1,342 @@
+/*
+ * LAUNCH.C
+ *
+ * Start a job or mailjob as a user without copying the daemon.  Everything
+ * that can fail slowly or needs memory - the passwd and group lookups, the
+ * environment - is done here in the parent.  The child is vfork()ed: it
+ * shares our memory and we are suspended until it has exec'd or given up,
+ * so all it does is a handful of system calls.
+ *
+ * A user's uid, gid, home, groups and environment are looked up once and
+ * cached, until PASSWD_FILE or GROUP_FILE changes or CredTTL (-C) runs out,
+ * so a busy minute doesn't ask NSS the same questions for every job.
+ *
+ * May be distributed under the GNU General Public License version 2 or any later version.
+ */
+
+#include "defs.h"
+
+Prototype pid_t Launch(const char *user, char *const argv[], int fd0, int fd1, int fd2, int cgfd, const char **failed);
+
+typedef struct UserCred {
+	char	*cr_Name;
+	uid_t	cr_Uid;
+	gid_t	cr_Gid;
+	char	*cr_Home;
+	gid_t	*cr_Groups;
+	int		cr_NGroups;
+	char	**cr_Env;		/* our environment, plus USER, LOGNAME, HOME and SHELL */
+	time_t	cr_Expires;
+} UserCred;
+
+typedef struct LaunchArgs {
+	char *const *la_Argv;
+	char	**la_Env;
+	gid_t	*la_Groups;
+	int		la_NGroups;
+	uid_t	la_Uid;
+	gid_t	la_Gid;
+	const char *la_Home;
+	int		la_Fd[3];
+	int		la_CgFd;
+	/* set by the child */
+	const char *la_Step;	/* what failed, or NULL */
+	int		la_Errno;
+	int		la_NoHome;		/* couldn't chdir to la_Home, used TempDir */
+} LaunchArgs;
+
+UserCred *GetCred(const char *user);
+void FreeCred(UserCred *cred);
+int CredFilesChanged(void);
+void LaunchChild(LaunchArgs *la);
+char **UserEnv(struct passwd *pas);
+
+extern char **environ;
+
+HashTable Creds;			/* cached UserCreds, by cr_Name */
+struct stat PasswdStat;		/* PASSWD_FILE and GROUP_FILE when Creds was last flushed */
+struct stat GroupStat;
+
+/*
+ * Launch() - run argv[0] as user, with fd0, fd1 and fd2 as its stdin, stdout
+ * and stderr (-1 leaves ours), in a new process group, and in the cgroup
+ * whose cgroup.procs is open on cgfd (-1 leaves ours)
+ *
+ * Returns the child's pid, or -1 if it couldn't be started.  If it started
+ * but couldn't become user or exec, *failed names the step that failed and
+ * errno says why; the child has then exited with status 0 and must be
+ * reaped as usual.  Otherwise *failed is NULL.
+ */
+pid_t
+Launch(const char *user, char *const argv[], int fd0, int fd1, int fd2, int cgfd, const char **failed)
+{
+	UserCred *cred;
+	struct timespec t0, t1;
+	LaunchArgs la;
+	pid_t pid;
+
+	*failed = NULL;
+	if ((cred = GetCred(user)) == NULL)
+		return(-1);
+
+	memset(&la, 0, sizeof(la));
+	la.la_Argv = argv;
+	la.la_Env = cred->cr_Env;
+	la.la_Groups = cred->cr_Groups;
+	la.la_NGroups = cred->cr_NGroups;
+	la.la_Uid = cred->cr_Uid;
+	la.la_Gid = cred->cr_Gid;
+	la.la_Home = cred->cr_Home;
+	la.la_Fd[0] = fd0;
+	la.la_Fd[1] = fd1;
+	la.la_Fd[2] = fd2;
+	la.la_CgFd = cgfd;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((pid = vfork()) == 0)
+		LaunchChild(&la);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (pid > 0 && !la.la_Step) {
+		if (la.la_NoHome)
+			printlogf(LOG_ERR, "chdir failed: %s %s\n", user, cred->cr_Home);
+		if (DebugOpt)
+			printlogf(LOG_DEBUG, "started %s as user %s, pid %d, in %ld us\n", argv[0], user, (int)pid,
+					(long)((t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000));
+	}
+	*failed = la.la_Step;
+	if (*failed)
+		errno = la.la_Errno;
+	return(pid);
+}
+
+/*
+ * GetCred() - user's credentials, from the cache if they're still good
+ */
+UserCred *
+GetCred(const char *user)
+{
+	unsigned long hash = HashString(HASH_INIT, user);
+	struct passwd *pas;
+	UserCred *cred;
+	HashNode *hn;
+	time_t t = time(NULL);
+	int n;
+
+	if (CredFilesChanged()) {
+		if (DebugOpt && Creds.ht_Count)
+			printlogf(LOG_DEBUG, "%s or %s changed, forgetting cached users\n", PASSWD_FILE, GROUP_FILE);
+		for (n = 0; Creds.ht_Buckets && n <= Creds.ht_Mask; ++n)
+			for (hn = Creds.ht_Buckets[n]; hn; hn = hn->hn_Next)
+				FreeCred(hn->hn_Data);
+		HashFree(&Creds);
+	}
+
+	for (hn = HashFirst(&Creds, hash); hn; hn = HashNext(hn)) {
+		cred = hn->hn_Data;
+		if (strcmp(cred->cr_Name, user) == 0) {
+			/* also look again if the clock was set back */
+			if (t < cred->cr_Expires && t >= cred->cr_Expires - CredTTL)
+				return(cred);
+			HashDel(&Creds, hn);
+			FreeCred(cred);
+			break;
+		}
+	}
+
+	if ((pas = getpwnam(user)) == NULL) {
+		printlogf(LOG_ERR, "failed to get uid for %s\n", user);
+		return(NULL);
+	}
+	if (!(cred = calloc(1, sizeof(UserCred))) ||
+			!(cred->cr_Name = strdup(user)) ||
+			!(cred->cr_Home = strdup(pas->pw_dir))
+	   ) {
+		errno = ENOMEM;
+		perror("GetCred");
+		exit(1);
+	}
+	cred->cr_Uid = pas->pw_uid;
+	cred->cr_Gid = pas->pw_gid;
+	cred->cr_Env = UserEnv(pas);
+	cred->cr_NGroups = 32;
+	for (;;) {
+		n = cred->cr_NGroups;
+		if (!(cred->cr_Groups = malloc(n * sizeof(gid_t)))) {
+			errno = ENOMEM;
+			perror("GetCred");
+			exit(1);
+		}
+		if (getgrouplist(user, cred->cr_Gid, cred->cr_Groups, &cred->cr_NGroups) >= 0)
+			break;
+		free(cred->cr_Groups);
+		if (cred->cr_NGroups <= n)
+			cred->cr_NGroups = n * 2;
+	}
+	cred->cr_Expires = t + CredTTL;
+	HashAdd(&Creds, hash, cred);
+	if (DebugOpt)
+		printlogf(LOG_DEBUG, "looked up user %s: uid %d gid %d, %d groups\n",
+				user, (int)cred->cr_Uid, (int)cred->cr_Gid, cred->cr_NGroups);
+	return(cred);
+}
+
+void
+FreeCred(UserCred *cred)
+{
+	int i, n;
+
+	/* the strings UserEnv allocated are the last four */
+	for (n = 0; cred->cr_Env[n]; ++n)
+		;
+	for (i = n - 4; i < n; ++i)
+		free(cred->cr_Env[i]);
+	free(cred->cr_Env);
+	free(cred->cr_Groups);
+	free(cred->cr_Home);
+	free(cred->cr_Name);
+	free(cred);
+}
+
+/*
+ * CredFilesChanged() - has PASSWD_FILE or GROUP_FILE been changed or
+ * replaced since we last looked?
+ */
+int
+CredFilesChanged(void)
+{
+	struct stat pst, gst;
+	int changed;
+
+	if (stat(PASSWD_FILE, &pst) < 0)
+		memset(&pst, 0, sizeof(pst));
+	if (stat(GROUP_FILE, &gst) < 0)
+		memset(&gst, 0, sizeof(gst));
+	changed = pst.st_ino != PasswdStat.st_ino || pst.st_dev != PasswdStat.st_dev ||
+		pst.st_mtim.tv_sec != PasswdStat.st_mtim.tv_sec || pst.st_mtim.tv_nsec != PasswdStat.st_mtim.tv_nsec ||
+		gst.st_ino != GroupStat.st_ino || gst.st_dev != GroupStat.st_dev ||
+		gst.st_mtim.tv_sec != GroupStat.st_mtim.tv_sec || gst.st_mtim.tv_nsec != GroupStat.st_mtim.tv_nsec;
+	PasswdStat = pst;
+	GroupStat = gst;
+	return(changed);
+}
+
+/*
+ * LaunchChild() - runs in the vfork()ed child, in our memory; never returns
+ *
+ * Only system calls from here: no stdio, no malloc, no logging.  The
+ * credential calls go straight to the kernel, so that the C library can't
+ * try to apply them to what it thinks are our other threads.
+ */
+void
+LaunchChild(LaunchArgs *la)
+{
+	sigset_t mask;
+	int i;
+
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+
+	/* "0" is whoever writes it */
+	if (la->la_CgFd >= 0 && write(la->la_CgFd, "0", 1) < 0) {
+		la->la_Step = "join cgroup";
+		goto fail;
+	}
+
+#ifdef SYS_setgroups32
+	if (syscall(SYS_setgroups32, la->la_NGroups, la->la_Groups) < 0) {
+#else
+	if (syscall(SYS_setgroups, la->la_NGroups, la->la_Groups) < 0) {
+#endif
+		la->la_Step = "setgroups";
+		goto fail;
+	}
+#ifdef SYS_setresgid32
+	if (syscall(SYS_setresgid32, la->la_Gid, la->la_Gid, la->la_Gid) < 0) {
+#else
+	if (syscall(SYS_setresgid, la->la_Gid, la->la_Gid, la->la_Gid) < 0) {
+#endif
+		la->la_Step = "setgid";
+		goto fail;
+	}
+#ifdef SYS_setresuid32
+	if (syscall(SYS_setresuid32, la->la_Uid, la->la_Uid, la->la_Uid) < 0) {
+#else
+	if (syscall(SYS_setresuid, la->la_Uid, la->la_Uid, la->la_Uid) < 0) {
+#endif
+		la->la_Step = "setuid";
+		goto fail;
+	}
+
+	/* from this point we are unpriviledged */
+
+	if (chdir(la->la_Home) < 0) {
+		la->la_NoHome = 1;
+		if (chdir(TempDir) < 0) {
+			la->la_Step = "chdir";
+			goto fail;
+		}
+	}
+	for (i = 0; i < 3; ++i) {
+		if (la->la_Fd[i] >= 0 && dup2(la->la_Fd[i], i) < 0) {
+			la->la_Step = "dup2";
+			goto fail;
+		}
+	}
+
+	/* our raised RLIMIT_NOFILE is ours, not the job's */
+	if (FileLimitRaised && setrlimit(RLIMIT_NOFILE, &JobFileLimit) < 0) {
+		la->la_Step = "setrlimit";
+		goto fail;
+	}
+
+	/*
+	 * Start a new process group, so that the job and anything it spawns
+	 * are kept apart from crond and its mailjobs.
+	 */
+	setpgid(0, 0);
+
+	execve(la->la_Argv[0], la->la_Argv, la->la_Env);
+	la->la_Step = "exec";
+fail:
+	la->la_Errno = errno;
+	_exit(0);
+}
+
+/*
+ * UserEnv() - our environment, with USER, LOGNAME, HOME and SHELL set for pas
+ *
+ * The four new strings are the last four entries; FreeCred() relies on it.
+ */
+char **
+UserEnv(struct passwd *pas)
+{
+	char **env;
+	char **penv;
+	int n = 0;
+
+	for (penv = environ; *penv; ++penv)
+		++n;
+	if (!(env = malloc((n + 5) * sizeof(char *)))) {
+		errno = ENOMEM;
+		perror("UserEnv");
+		exit(1);
+	}
+	n = 0;
+	for (penv = environ; *penv; ++penv) {
+		if (strncmp(*penv, "USER=", 5) != 0 && strncmp(*penv, "LOGNAME=", 8) != 0 &&
+				strncmp(*penv, "HOME=", 5) != 0 && strncmp(*penv, "SHELL=", 6) != 0)
+			env[n++] = *penv;
+	}
+	if (!(env[n++] = concat("USER=", pas->pw_name, NULL)) ||
+			!(env[n++] = concat("LOGNAME=", pas->pw_name, NULL)) ||
+			!(env[n++] = concat("HOME=", pas->pw_dir, NULL)) ||
+			!(env[n++] = concat("SHELL=", "/bin/sh", NULL))
+	   ) {
+		errno = ENOMEM;
+		perror("UserEnv");
+		exit(1);
+	}
+	env[n] = NULL;
+	return(env);
+}
@@ -2,7 +2,7 @@
 /*
  * MAIN.C
  *
- * crond [-s dir] [-c dir] [-t dir] [-m user@host] [-M mailer] [-S|-L [file]] [-l level] [-b|-f|-d]
+ * crond [-s dir] [-c dir] [-t dir] [-m user@host] [-M mailer] [-j jobs] [-J jobs] [-g] [-D interval] [-T interval] [-C interval] [-k] [-p] [-S|-L [file]] [-l level] [-b|-f|-d]
  * run as root, but NOT setuid root
  *
  * Copyright 1994 Matthew Dillon (dillon@apollo.backplane.com)
@@ -27,6 +27,16 @@ Prototype const char *SendMail;
 Prototype const char *Mailto;
 Prototype char *TempDir;
 Prototype char *TempFileFmt;
+Prototype long MaxJobs;
+Prototype int MaxUserJobs;
+Prototype short CgroupOpt;
+Prototype int DigestWindow;
+Prototype int JobTimeout;
+Prototype int CredTTL;
+Prototype short StampOpt;
+Prototype short SnapshotOpt;
+Prototype struct rlimit JobFileLimit;
+Prototype short FileLimitRaised;
 
 short DebugOpt = 0;
 short LogLevel = LOG_LEVEL;
@@ -41,6 +51,16 @@ const char *SendMail = NULL;
 const char *Mailto = NULL;
 char *TempDir;
 char *TempFileFmt;
+long MaxJobs = 0;		/* limit on running jobs, or 0 */
+int MaxUserJobs = 0;	/* limit on running jobs per user, or 0 */
+short CgroupOpt = 0;
+int DigestWindow = 0;	/* seconds to collect job output for, or 0 */
+int JobTimeout = 0;		/* seconds jobs without TIMEOUT= may run, or 0 */
+int CredTTL = CRED_TTL;		/* seconds a user's cached credentials are trusted */
+short StampOpt = 0;
+short SnapshotOpt = 0;
+struct rlimit JobFileLimit;		/* RLIMIT_NOFILE we were started with, for jobs */
+short FileLimitRaised = 0;
 
 uid_t DaemonUid;
 pid_t DaemonPid;
@@ -63,6 +83,7 @@ main(int ac, char **av)
 		NULL
 	};
 	int i;
+	int watchfd;
 
 	/*
 	 * parse options
@@ -72,7 +93,7 @@ main(int ac, char **av)
 
 	opterr = 0;
 
-	while ((i = getopt(ac,av,"dl:L:fbSc:s:m:M:t:")) != -1) {
+	while ((i = getopt(ac,av,"dl:L:fbSc:s:m:M:t:j:J:gD:T:C:kp")) != -1) {
 		switch (i) {
 			case 'l':
 				{
@@ -161,17 +182,58 @@ main(int ac, char **av)
 			case 'm':
 				if (*optarg != 0) Mailto = optarg;
 				break;
+			case 'j':
+				MaxJobs = atoi(optarg);
+				break;
+			case 'J':
+				MaxUserJobs = atoi(optarg);
+				break;
+			case 'g':
+				CgroupOpt = 1;
+				break;
+			case 'k':
+				StampOpt = 1;
+				break;
+			case 'p':
+				SnapshotOpt = 1;
+				break;
+			case 'D':
+				if (ParseInterval(&DigestWindow, optarg) == NULL) {
+					fdprintf(2, "bad digest interval '%s'\n", optarg);
+					exit(2);
+				}
+				break;
+			case 'T':
+				if (ParseInterval(&JobTimeout, optarg) == NULL) {
+					fdprintf(2, "bad timeout '%s'\n", optarg);
+					exit(2);
+				}
+				break;
+			case 'C':
+				if (ParseInterval(&CredTTL, optarg) == NULL) {
+					fdprintf(2, "bad interval '%s'\n", optarg);
+					exit(2);
+				}
+				break;
 			default:
 				/*
 				 * check for parse error
 				 */
 				printf("dillon's cron daemon " VERSION "\n");
-				printf("crond [-s dir] [-c dir] [-t dir] [-m user@host] [-M mailer] [-S|-L [file]] [-l level] [-b|-f|-d]\n");
+				printf("crond [-s dir] [-c dir] [-t dir] [-m user@host] [-M mailer] [-j jobs] [-J jobs] [-g] [-D interval] [-T interval] [-C interval] [-k] [-p] [-S|-L [file]] [-l level] [-b|-f|-d]\n");
 				printf("-s            directory of system crontabs (defaults to %s)\n", SCRONTABS);
 				printf("-c            directory of per-user crontabs (defaults to %s)\n", CRONTABS);
 				printf("-t            directory of timestamps (defaults to %s)\n", CRONSTAMPS);
 				printf("-m user@host  where should cron output be directed? (defaults to local user)\n");
 				printf("-M mailer     (defaults to %s)\n", SENDMAIL);
+				printf("-j jobs       run at most this many jobs at once, queueing the rest (default no limit)\n");
+				printf("-J jobs       run at most this many jobs at once for any one user (default no limit)\n");
+				printf("-g            run each job in a cgroup of its own\n");
+				printf("-D interval   mail each user's job output at most once per interval (e.g. 1h), as a digest\n");
+				printf("-T interval   stop jobs without a TIMEOUT= tag that run longer than interval (default no limit)\n");
+				printf("-C interval   look users up again after interval (e.g. 5m; defaults to %dm)\n", CRED_TTL / 60);
+				printf("-k            keep timestamps in one file, %s in the timestamp directory\n", STAMPFILE);
+				printf("-p            keep the parsed crontabs in %s in the timestamp directory, to start faster\n", SNAPFILE);
 				printf("-S            log to syslog using identity '%s' (default)\n", LOG_IDENT);
 				printf("-L file       log to specified file instead of syslog\n");
 				printf("-l loglevel   log events <= this level (defaults to %s (level %d))\n", LevelAry[LOG_LEVEL], LOG_LEVEL);
@@ -283,13 +345,38 @@ main(int ac, char **av)
         close(i);
     }
 
+	/*
+	 * each running job's output is held open in a memfd; allow for plenty.
+	 * Jobs get the limit back as it was (see LaunchChild).
+	 */
+	{
+		struct rlimit rl;
+
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+			JobFileLimit = rl;
+			rl.rlim_cur = rl.rlim_max;
+			if (setrlimit(RLIMIT_NOFILE, &rl) == 0)
+				FileLimitRaised = 1;
+		}
+	}
+
 
 	/*
-	 * main loop - synchronize to 1 second after the minute, minimum sleep
-	 *             of 1 second.
+	 * main loop - sleep until something is due: the earliest queued job,
+	 *             or without inotify, the once-a-minute poll of
+	 *             cron.update and the hourly rescan.  A finished child
+	 *             or a changed crontab or timestamp wakes us too.
 	 */
 
 	printlogf(LOG_NOTICE,"%s " VERSION " dillon's cron daemon, started with loglevel %s\n", av[0], LevelAry[LogLevel]);
+	SchedTime = time(NULL);
+	if (CgroupOpt)
+		CgroupInit();
+	if (StampOpt)
+		StampInit();
+	watchfd = WatchDirs();
+	if (SnapshotOpt)
+		LoadSnapshot();
 	SynchronizeDir(CDir, NULL, 1);
 	SynchronizeDir(SCDir, "root", 1);
 	ReadTimestamps(NULL);
@@ -298,20 +385,135 @@ main(int ac, char **av)
 	{
 		time_t t1 = time(NULL);
 		time_t t2;
+		time_t wake;
+		time_t next;
+		time_t rescan;		/* when to rescan the directories, or 0 */
+		time_t recal;		/* when to rebuild the calendar */
+		short rewatch = 0;	/* lost our watches: try again each minute */
+		time_t snapdue;		/* when to write the changed snapshot, or 0 */
+		time_t polled = t1;	/* when cron.update was last polled */
+		int lost;
 		long dt;
-		short rescan = 60;
-		short stime = 60;
+		struct timespec ts;
+		struct itimerspec its;
+		struct pollfd pfd[4];
+		struct signalfd_siginfo si;
+		uint64_t ticks;
+
+		pfd[0].fd = openchildfd();
+		pfd[0].events = POLLIN;
+		if ((pfd[1].fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC)) < 0) {
+			perror("timerfd_create");
+			exit(1);
+		}
+		pfd[1].events = POLLIN;
+		pfd[2].fd = watchfd;
+		pfd[2].events = POLLIN;
+		/* the running jobs' output, as it's written */
+		pfd[3].fd = OutputPoll();
+		pfd[3].events = POLLIN;
+		memset(&its, 0, sizeof(its));
+
+		/*
+		 * Without inotify we poll cron.update every minute, and rescan
+		 * every hour to pick up changes made without it.
+		 */
+		rescan = (watchfd < 0) ? t1 + 60*60 : 0;
+
+		/*
+		 * The calendar caches local days, and the heap keys come from
+		 * it.  With inotify we may never rescan, so it is rebuilt daily
+		 * in case the zone's rules changed under us.
+		 */
+		recal = t1 + 24*60*60;
+		snapdue = (SnapshotOpt && SnapshotDirty) ? t1 + SNAPSHOT_DELAY : 0;
 
 		for (;;) {
-			sleep((stime + 1) - (short)(time(NULL) % stime));
-
-			t2 = time(NULL);
+			/*
+			 * The deadline is absolute and on the realtime clock, so we
+			 * wake on time across a suspend; setting the clock wakes us
+			 * too, to work out a new deadline.  We read the clock we
+			 * sleep on rather than use time(), which may lag it by a
+			 * tick.
+			 */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			t2 = ts.tv_sec;
+			wake = (watchfd < 0) ? t2 - t2 % 60 + 60 : 0;
+			next = NextScheduledTime();
+			if (next != (time_t)-1 && (!wake || next < wake))
+				wake = next;
+			if (rescan && (!wake || rescan < wake))
+				wake = rescan;
+			if (!wake || recal < wake)
+				wake = recal;
+			if (snapdue && snapdue < wake)
+				wake = snapdue;
+			next = NextDigestTime();
+			if (next != (time_t)-1 && (!wake || next < wake))
+				wake = next;
+			/* this also signals the jobs that are overdue */
+			next = CheckTimeouts(t2);
+			if (next && (!wake || next < wake))
+				wake = next;
+			/* a zero deadline disarms the timer */
+			its.it_value.tv_sec = wake;
+			timerfd_settime(pfd[1].fd, TFD_TIMER_ABSTIME|TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+			pfd[0].revents = pfd[1].revents = pfd[2].revents = pfd[3].revents = 0;
+			poll(pfd, 4, -1);
+			if (pfd[1].revents & POLLIN)
+				/* fails with ECANCELED if the clock was set; nothing to do */
+				read(pfd[1].fd, &ticks, sizeof(ticks));
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			t2 = ts.tv_sec;
 			dt = t2 - t1;
 
+			if (pfd[3].revents & POLLIN) {
+				CollectOutput();
+				/* nothing else is due, so the rest can wait */
+				if (!(pfd[0].revents | pfd[1].revents | pfd[2].revents))
+					continue;
+			}
+
+			if (pfd[0].revents & POLLIN) {
+				while (read(pfd[0].fd, &si, sizeof(si)) > 0) {
+					if (si.ssi_signo == SIGTERM || si.ssi_signo == SIGINT) {
+						/* running jobs carry on without us, but not their output */
+						FlushDigests((time_t)-1);
+						SyncTimestamps();
+						if (SnapshotOpt)
+							SaveSnapshot();
+						printlogf(LOG_NOTICE, "stopped by signal %d\n", (int)si.ssi_signo);
+						exit(0);
+					}
+				}
+				ReapJobs();
+			}
+			/* cgroups of ended jobs that weren't empty yet */
+			CgroupReap();
+			FlushDigests(t2);
+			if ((pfd[2].revents & POLLIN) && (lost = ReadWatches(watchfd, t1, t2)) != 0) {
+				if (lost < 0) {
+					/* as though we never had inotify, until we can watch again */
+					close(watchfd);
+					watchfd = pfd[2].fd = -1;
+					rewatch = 1;
+				}
+				rescan = t2;
+			} else if (rewatch && (watchfd = WatchDirs()) >= 0) {
+				pfd[2].fd = watchfd;
+				rewatch = 0;
+				rescan = t2;
+			}
+
 			/*
 			 * The file 'cron.update' is checked to determine new cron
 			 * jobs.  The directory is rescanned once an hour to deal
-			 * with any screwups.
+			 * with any screwups.  With inotify, changed crontabs and
+			 * cron.update are picked up by ReadWatches as they're
+			 * written, and we only rescan if it lost events, or one of
+			 * the directories went away; if it can't be watched again,
+			 * we go back to polling.
 			 *
 			 * check for disparity.  Disparities over an hour either way
 			 * result in resynchronization.  A reverse-indexed disparity
@@ -319,44 +521,73 @@ main(int ac, char **av)
 			 * match the original time (i.e. no re-execution of jobs that
 			 * have just been run).  A forward-indexed disparity less then
 			 * an hour causes intermediate jobs to be run, but only once
-			 * in the worst case.
+			 * in the worst case.  Catching up costs the same however big
+			 * the disparity: TestJobs only visits jobs with a run time in
+			 * the gap, and each of them once.  Since we may sleep for
+			 * hours when nothing is due, a forward disparity is measured
+			 * from the deadline we slept until, not from the last scan.
 			 *
 			 * when running jobs, the inequality used is greater but not
 			 * equal to t1, and less then or equal to t2.
 			 */
 
-			if (--rescan == 0) {
+			if (rescan && t2 >= rescan) {
 				/*
 				 * If we resynchronize while jobs are running, we'll clobber
 				 * the job pids, so we won't know what's already running.
 				 */
 				if (CheckJobs() > 0) {
-					rescan = 1;
+					rescan = t2 - t2 % 60 + 60;
 				} else {
-					rescan = 60;
+					rescan = (watchfd < 0) ? t2 + 60*60 : 0;
+					recal = t2;
 					SynchronizeDir(CDir, NULL, 0);
 					SynchronizeDir(SCDir, "root", 0);
 					ReadTimestamps(NULL);
 				}
-			} 
-			if (rescan < 60) {
-				CheckUpdates(CDir, NULL, t1, t2);
-				CheckUpdates(SCDir, "root", t1, t2);
+			} else if (watchfd < 0 && t2 / 60 != polled / 60) {
+				/* child exits and timeouts wake us too; poll once a minute */
+				polled = t2;
+				CheckUpdates(CDir, NULL, t1, t2, 0);
+				CheckUpdates(SCDir, "root", t1, t2, 0);
+			}
+			if (t2 >= recal) {
+				recal = t2 + 24*60*60;
+				FlushCalendar();
+				RescheduleLines(SchedTime);
 			}
 			if (DebugOpt)
 				printlogf(LOG_DEBUG, "Wakeup dt=%d\n", dt);
-			if (dt < -60*60 || dt > 60*60) {
+			if (dt < -60*60 || (wake && t2 - wake > 60*60)) {
 				t1 = t2;
+				FlushCalendar();
+				RescheduleLines(t2);
 				printlogf(LOG_NOTICE,"time disparity of %d minutes detected\n", dt / 60);
 			} else if (dt > 0) {
 				TestJobs(t1, t2);
 				RunJobs();
-				sleep(5);
-				if (CheckJobs() > 0)
-					stime = 10;
-				else
-					stime = 60;
 				t1 = t2;
+			} else if (WaitersChanged) {
+				/* a notifier finished, but no new minute to test */
+				TestJobs(t1, t1);
+				RunJobs();
+			} else if (JobsQueued) {
+				/* a job may have finished, making room for a queued one */
+				RunJobs();
+			}
+			/* one sync for the stamps of all the jobs that ended */
+			SyncTimestamps();
+			/*
+			 * A changed snapshot is written at most every SNAPSHOT_DELAY
+			 * seconds, not after every crontab edit: it holds them all.
+			 */
+			if (SnapshotOpt && SnapshotDirty) {
+				if (!snapdue)
+					snapdue = t2 + SNAPSHOT_DELAY;
+				else if (t2 >= snapdue) {
+					SaveSnapshot();
+					snapdue = 0;
+				}
 			}
 		}
 	}
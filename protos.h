@@ -0,0 +1,106 @@
+Prototype short DebugOpt;
+Prototype short LogLevel;
+Prototype short ForegroundOpt;
+Prototype short SyslogOpt;
+Prototype const char *CDir;
+Prototype const char *SCDir;
+Prototype const char *TSDir;
+Prototype const char *LogFile;
+Prototype const char *LogHeader;
+Prototype uid_t DaemonUid;
+Prototype pid_t DaemonPid;
+Prototype const char *SendMail;
+Prototype const char *Mailto;
+Prototype char *TempDir;
+Prototype char *TempFileFmt;
+Prototype long MaxJobs;
+Prototype int MaxUserJobs;
+Prototype short CgroupOpt;
+Prototype int DigestWindow;
+Prototype int JobTimeout;
+Prototype int CredTTL;
+Prototype short StampOpt;
+Prototype short SnapshotOpt;
+Prototype struct rlimit JobFileLimit;
+Prototype short FileLimitRaised;
+Prototype void printlogf(int level, const char *ctl, ...);
+Prototype void fdprintlogf(int level, int fd, const char *ctl, ...);
+Prototype void fdprintf(int fd, const char *ctl, ...);
+Prototype void initsignals(void);
+Prototype int openchildfd(void);
+Prototype void unblocksignals(void);
+Prototype char Hostname[SMALL_BUFFER];
+Prototype void CheckUpdates(const char *dpath, const char *user_override, time_t t1, time_t t2, short watched);
+Prototype void SynchronizeDir(const char *dpath, const char *user_override, int initial_scan);
+Prototype void ReadTimestamps(const char *user);
+Prototype void ReadTimestamp(CronFile *file, CronLine *line);
+Prototype void WriteTimestamp(CronFile *file, CronLine *line, int exit_status);
+Prototype void SyncTimestamps(void);
+Prototype void CheckTimestamp(CronLine *line);
+Prototype void KnowStamp(const char *path, time_t lastRan, time_t notUntil, struct stat *sbuf);
+Prototype void LinkFile(CronFile *file);
+Prototype HashTable KnownStamps;
+Prototype short SnapshotDirty;
+Prototype void SynchronizeFile(const char *dpath, const char *fname, const char *uname);
+Prototype int TestJobs(time_t t1, time_t t2);
+Prototype int TestStartupJobs(void);
+Prototype int ArmJob(CronFile *file, CronLine *line, time_t t1, time_t t2);
+Prototype void RunJobs(void);
+Prototype int CheckJobs(void);
+Prototype void ReapJobs(void);
+Prototype time_t CheckTimeouts(time_t t);
+Prototype short WaitersChanged;
+Prototype int JobsQueued;
+Prototype CronFile *FileBase;
+Prototype CronFile *FindUserFile(const char *user, CronFile *prev);
+Prototype CronFile *FindFile(const char *dpath, const char *fname);
+Prototype CronLine *FindJob(CronFile *file, const char *name);
+Prototype char *ParseInterval(int *interval, char *ptr);
+Prototype time_t SchedTime;
+Prototype void FlushCalendar(void);
+Prototype int FiresWithin(CronLine *line, time_t t1, time_t t2);
+Prototype time_t NextFireTime(CronLine *line, time_t after);
+Prototype void ScheduleLine(CronLine *line, time_t after);
+Prototype void UnscheduleLine(CronLine *line);
+Prototype void RescheduleLines(time_t t);
+Prototype CronLine *PopDueLine(time_t t2);
+Prototype time_t NextScheduledTime(void);
+Prototype unsigned long HashString(unsigned long hash, const char *str);
+Prototype unsigned long HashInt(unsigned long val);
+Prototype HashNode *HashAdd(HashTable *ht, unsigned long hash, void *data);
+Prototype void HashDel(HashTable *ht, HashNode *hn);
+Prototype HashNode *HashFirst(HashTable *ht, unsigned long hash);
+Prototype HashNode *HashNext(HashNode *hn);
+Prototype void HashFree(HashTable *ht);
+Prototype int WatchDirs(void);
+Prototype int ReadWatches(int fd, time_t t1, time_t t2);
+Prototype int TSDirWd;
+Prototype void RunJob(CronFile *file, CronLine *line);
+Prototype void EndJob(CronFile *file, CronLine *line, int exit_status);
+Prototype void MailOutput(const char *user, const char *desc, int mailFd);
+Prototype int OutputFd(void);
+Prototype int OutputPoll(void);
+Prototype void CollectOutput(void);
+Prototype const char *SendMail;
+Prototype pid_t Launch(const char *user, char *const argv[], int fd0, int fd1, int fd2, int cgfd, const char **failed);
+Prototype void CgroupInit(void);
+Prototype int CgroupCreate(CronFile *file, CronLine *line);
+Prototype void CgroupEnd(CronFile *file, CronLine *line);
+Prototype int CgroupKill(CronLine *line);
+Prototype void CgroupReap(void);
+Prototype int DigestOutput(CronFile *file, CronLine *line, int mailFd, int exit_status);
+Prototype void FlushDigests(time_t t);
+Prototype time_t NextDigestTime(void);
+Prototype void StartStats(CronLine *line);
+Prototype void RecordStats(CronFile *file, CronLine *line, int status, struct rusage *ru);
+Prototype void FreeStats(CronLine *line);
+Prototype void StampInit(void);
+Prototype int StampGet(const char *user, const char *job, time_t *lastRan, time_t *notUntil);
+Prototype int StampPut(const char *user, const char *job, time_t lastRan, time_t notUntil, int exit_status);
+Prototype void StampSync(void);
+Prototype void LoadSnapshot(void);
+Prototype void SaveSnapshot(void);
+Prototype char *concat(const char *s1, ...);
+Prototype int ChangeUser(const char *user, char *dochdir);
+Prototype void printlogf(int level, const char *ctl, ...);
+Prototype int ChangeUser(const char *user, char *dochdir);
@@ -0,0 +1,434 @@
+/*
+ * SCHED.C
+ *
+ * Next-fire-time computation for CronLines, and the heap that keeps them
+ * ordered by that time, so TestJobs() only has to look at jobs that are due.
+ *
+ * May be distributed under the GNU General Public License version 2 or any later version.
+ */
+
+#include "defs.h"
+
+Prototype time_t SchedTime;
+Prototype void FlushCalendar(void);
+Prototype int FiresWithin(CronLine *line, time_t t1, time_t t2);
+Prototype time_t NextFireTime(CronLine *line, time_t after);
+Prototype void ScheduleLine(CronLine *line, time_t after);
+Prototype void UnscheduleLine(CronLine *line);
+Prototype void RescheduleLines(time_t t);
+Prototype CronLine *PopDueLine(time_t t2);
+Prototype time_t NextScheduledTime(void);
+
+/*
+ * Minutes <= SchedTime have already been tested; lines (re)loaded between
+ * scans are scheduled from here.
+ */
+time_t SchedTime;
+
+/*
+ * The heap is 1-based, so that cl_HeapIdx == 0 means "not queued".
+ */
+CronLine **Heap = NULL;
+int HeapLen = 0;
+int HeapMax = 0;
+
+long DaysFromCivil(long y, int mon, int mday);
+int DaysInMonth(int y, int mon);
+time_t AdvanceTo(time_t t, struct tm *tm);
+int Ctz64(uint64_t mask);
+void HeapSwap(int i, int j);
+void SiftUp(int i);
+void SiftDown(int i);
+
+/*
+ * The calendar cache: one CronDay per local day, holding everything the
+ * matcher needs to know about it.  Building one costs a localtime() and
+ * two mktime()s; after that, on days without a clock change, minutes are
+ * plain arithmetic from cd_Start.  It is direct-mapped on the UTC day
+ * number of cd_Start, which is always within two days of any t in it.
+ */
+typedef struct CronDay {
+	time_t	cd_Start;	/* local midnight			*/
+	time_t	cd_End;		/* next local midnight			*/
+	int		cd_Year;
+	int		cd_Mon;		/* 0-11					*/
+	int		cd_MDay;	/* 1-31					*/
+	int		cd_WDay;	/* 0-6, beginning sunday		*/
+	char	cd_NWday;	/* FIRST_DOW..FIFTH_DOW, and LAST_DOW	*/
+	short	cd_Steady;	/* bool: no clock change during the day	*/
+} CronDay;
+
+#define DAY_CACHE	64	/* power of two */
+
+CronDay DayCache[DAY_CACHE];
+
+/*
+ * Days since 1970-01-01 of a proleptic Gregorian date (mon 1-12)
+ */
+long
+DaysFromCivil(long y, int mon, int mday)
+{
+	long era, yoe, doy;
+
+	y -= mon <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + mday - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+int
+DaysInMonth(int y, int mon)
+{
+	static const char mdays[FIELD_MONTHS] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+	if (mon == 1 && y % 4 == 0 && (y % 100 != 0 || y % 400 == 0))
+		return 29;
+	return mdays[mon];
+}
+
+/*
+ * GetDay() - the CronDay containing t
+ */
+CronDay *
+GetDay(time_t t)
+{
+	long n = t / 86400;
+	CronDay *day;
+	struct tm tm;
+	int i;
+
+	for (i = 0; i < 3; ++i) {
+		day = &DayCache[(n - i) & (DAY_CACHE - 1)];
+		if (day->cd_Start <= t && t < day->cd_End)
+			return day;
+	}
+
+	tm = *localtime(&t);
+	{
+		CronDay d;
+
+		d.cd_Year = tm.tm_year + 1900;
+		d.cd_Mon = tm.tm_mon;
+		d.cd_MDay = tm.tm_mday;
+		d.cd_WDay = tm.tm_wday;
+		d.cd_NWday = 1 << ((d.cd_MDay - 1) / 7);
+		if (d.cd_MDay + 7 > DaysInMonth(d.cd_Year, d.cd_Mon))
+			d.cd_NWday |= LAST_DOW;	/* last dow in month is always recognized as 6th bit */
+
+		tm.tm_hour = 0;
+		tm.tm_min = 0;
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		d.cd_Start = mktime(&tm);
+		tm.tm_year = d.cd_Year - 1900;
+		tm.tm_mon = d.cd_Mon;
+		tm.tm_mday = d.cd_MDay + 1;
+		tm.tm_hour = 0;
+		tm.tm_min = 0;
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		d.cd_End = mktime(&tm);
+
+		if (d.cd_Start == (time_t)-1 || d.cd_Start > t || d.cd_End <= t) {
+			/* midnight fell in a clock change; just cache this minute */
+			d.cd_Start = t - t % 60;
+			d.cd_End = d.cd_Start + 60;
+			d.cd_Steady = 0;
+		} else {
+			/* same UTC offset at both midnights? */
+			long days = DaysFromCivil(d.cd_Year, d.cd_Mon + 1, d.cd_MDay);
+			d.cd_Steady = (days * 86400 - d.cd_Start == (days + 1) * 86400 - d.cd_End);
+		}
+		day = &DayCache[(d.cd_Start / 86400) & (DAY_CACHE - 1)];
+		*day = d;
+	}
+	return day;
+}
+
+/*
+ * FlushCalendar() - forget cached days, e.g. after a time or zone change
+ */
+void
+FlushCalendar(void)
+{
+	memset(DayCache, 0, sizeof(DayCache));
+}
+
+/*
+ * NextFireTime() - first minute > after matching line's schedule
+ *
+ * This finds the same minute a minute-by-minute scan would, but jumps
+ * straight to the next month, day, hour or minute whose bit is set.
+ * Days come from the calendar cache, so apart from skipping whole
+ * months this needs no libc time conversion, except on days when the
+ * clocks change; those are walked an hour at a time with localtime().
+ * Returns (time_t)-1 if nothing matches within SCHED_HORIZON.
+ */
+time_t
+NextFireTime(CronLine *line, time_t after)
+{
+	time_t t = after - after % 60 + 60;
+
+	while (t - after <= SCHED_HORIZON) {
+		CronDay *day = GetDay(t);
+		uint64_t rest;
+		int hour, min, d;
+
+		if (!(line->cl_Mons & (1 << day->cd_Mon))) {
+			/* skip to the 1st of the next month that matches */
+			struct tm tm;
+
+			memset(&tm, 0, sizeof(tm));
+			rest = line->cl_Mons & ~((2 << day->cd_Mon) - 1);
+			tm.tm_year = day->cd_Year - 1900;
+			tm.tm_mon = rest ? CTZ(rest) : CTZ(line->cl_Mons) + 12;
+			tm.tm_mday = 1;
+			t = AdvanceTo(t, &tm);
+			continue;
+		}
+		if (!(line->cl_Days & ((uint32_t)1 << day->cd_MDay)) ||
+				!(day->cd_NWday & DOW_BITS(line, day->cd_WDay))) {
+			/*
+			 * skip ahead to the next day whose DoM and DoW could both match,
+			 * or to the 1st of next month
+			 */
+			int dim = DaysInMonth(day->cd_Year, day->cd_Mon);
+
+			rest = line->cl_Days & ~(((uint64_t)2 << day->cd_MDay) - 1);
+			if (rest && CTZ(rest) <= dim) {
+				for (d = 1; d < 7 && !DOW_BITS(line, (day->cd_WDay + d) % 7); ++d)
+					;
+				d = (CTZ(rest) > day->cd_MDay + d) ? CTZ(rest) - day->cd_MDay : d;
+			} else
+				d = dim - day->cd_MDay + 1;
+			while (d-- > 0)
+				t = GetDay(t)->cd_End;
+			continue;
+		}
+		if (!day->cd_Steady) {
+			/* the clocks change today: go carefully */
+			struct tm *tp = localtime(&t);
+
+			if ((line->cl_Hrs & ((uint32_t)1 << tp->tm_hour)) &&
+					(rest = line->cl_Mins & (ALL_MINUTES << tp->tm_min)) != 0) {
+				min = CTZ(rest);
+				if (min == tp->tm_min)
+					return t;
+				t += (min - tp->tm_min) * 60;
+			} else
+				t += (60 - tp->tm_min) * 60;
+			continue;
+		}
+
+		hour = (t - day->cd_Start) / 3600;
+		min = (t - day->cd_Start) / 60 % 60;
+		if ((line->cl_Hrs & ((uint32_t)1 << hour)) &&
+				(rest = line->cl_Mins & (ALL_MINUTES << min)) != 0)
+			/* later this hour */
+			return day->cd_Start + hour * 3600 + CTZ(rest) * 60;
+		if ((rest = line->cl_Hrs & ~(((uint32_t)2 << hour) - 1)) != 0)
+			/* a later hour today */
+			return day->cd_Start + CTZ(rest) * 3600 + CTZ(line->cl_Mins) * 60;
+		t = day->cd_End;
+	}
+	return (time_t)-1;
+}
+
+/*
+ * FiresWithin() - does line's schedule have a minute in (t1, t2]?
+ *
+ * However long the period, this costs one NextFireTime().
+ */
+int
+FiresWithin(CronLine *line, time_t t1, time_t t2)
+{
+	time_t t = NextFireTime(line, t1);
+
+	return (t != (time_t)-1 && t <= t2);
+}
+
+/*
+ * AdvanceTo() - the local time in tm, as long as it's later than t
+ */
+time_t
+AdvanceTo(time_t t, struct tm *tm)
+{
+	time_t next;
+
+	tm->tm_sec = 0;
+	tm->tm_isdst = -1;
+	next = mktime(tm);
+	return (next > t) ? next : t + 60;
+}
+
+#ifdef NO_BUILTIN_CTZ
+int
+Ctz64(uint64_t mask)
+{
+	int n = 0;
+
+	while (!(mask & 1)) {
+		mask >>= 1;
+		++n;
+	}
+	return n;
+}
+#endif
+
+/*
+ * ScheduleLine() - (re)queue line at its next fire time after `after'
+ *
+ * @reboot and @noauto lines, and lines that will never match, are taken
+ * off the heap.  FREQ lines aren't queued before their cl_NotUntil, and
+ * SPREAD= lines are queued cl_Spread seconds late.
+ * The key only has to be a lower bound: TestJobs() rechecks every line
+ * it pops, and requeues it.
+ */
+void
+ScheduleLine(CronLine *line, time_t after)
+{
+	time_t t;
+	int i;
+
+	if (line->cl_Freq < 0) {
+		UnscheduleLine(line);
+		return;
+	}
+	/* a SPREAD= line is keyed cl_Spread seconds after the minute it fires */
+	after -= line->cl_Spread;
+	if (line->cl_Freq > 0 && after < line->cl_NotUntil - 60)
+		after = line->cl_NotUntil - 60;
+	if ((t = NextFireTime(line, after)) == (time_t)-1) {
+		UnscheduleLine(line);
+		return;
+	}
+	t += line->cl_Spread;
+
+	if ((i = line->cl_HeapIdx) == 0) {
+		if (HeapLen + 1 >= HeapMax) {
+			HeapMax = HeapMax ? HeapMax * 2 : 256;
+			if (!(Heap = realloc(Heap, HeapMax * sizeof(CronLine *)))) {
+				errno = ENOMEM;
+				perror("ScheduleLine");
+				exit(1);
+			}
+		}
+		i = ++HeapLen;
+		Heap[i] = line;
+		line->cl_HeapIdx = i;
+		line->cl_NextRun = t;
+		SiftUp(i);
+	} else {
+		time_t old = line->cl_NextRun;
+		line->cl_NextRun = t;
+		if (t < old)
+			SiftUp(i);
+		else
+			SiftDown(i);
+	}
+}
+
+void
+UnscheduleLine(CronLine *line)
+{
+	int i = line->cl_HeapIdx;
+
+	if (i == 0)
+		return;
+	line->cl_HeapIdx = 0;
+	if (i != HeapLen) {
+		Heap[i] = Heap[HeapLen--];
+		Heap[i]->cl_HeapIdx = i;
+		SiftUp(i);
+		SiftDown(i);
+	} else
+		--HeapLen;
+}
+
+/*
+ * RescheduleLines() - requeue every live line from t, and test from there
+ *
+ * After the clock jumps, the heap's keys are from the old time: a jump
+ * back would leave every line waiting for the clock to catch up.
+ */
+void
+RescheduleLines(time_t t)
+{
+	CronFile *file;
+	CronLine *line;
+
+	SchedTime = t;
+	for (file = FileBase; file; file = file->cf_Next) {
+		if (file->cf_Deleted)
+			continue;
+		for (line = file->cf_LineBase; line; line = line->cl_Next)
+			ScheduleLine(line, t);
+	}
+}
+
+/*
+ * PopDueLine() - take the earliest line off the heap, if it's due by t2
+ */
+CronLine *
+PopDueLine(time_t t2)
+{
+	CronLine *line;
+
+	if (HeapLen == 0 || Heap[1]->cl_NextRun > t2)
+		return(NULL);
+	line = Heap[1];
+	UnscheduleLine(line);
+	return(line);
+}
+
+/*
+ * NextScheduledTime() - when the earliest queued line is next due
+ *
+ * Returns -1 when nothing is queued.  Like every heap key this is a lower
+ * bound: the line may turn out not to run then, and is requeued.
+ */
+time_t
+NextScheduledTime(void)
+{
+	if (HeapLen == 0)
+		return((time_t)-1);
+	return(Heap[1]->cl_NextRun);
+}
+
+void
+HeapSwap(int i, int j)
+{
+	CronLine *line = Heap[i];
+
+	Heap[i] = Heap[j];
+	Heap[j] = line;
+	Heap[i]->cl_HeapIdx = i;
+	Heap[j]->cl_HeapIdx = j;
+}
+
+void
+SiftUp(int i)
+{
+	while (i > 1 && Heap[i]->cl_NextRun < Heap[i / 2]->cl_NextRun) {
+		HeapSwap(i, i / 2);
+		i /= 2;
+	}
+}
+
+void
+SiftDown(int i)
+{
+	for (;;) {
+		int j = 2 * i;
+
+		if (j > HeapLen)
+			break;
+		if (j < HeapLen && Heap[j + 1]->cl_NextRun < Heap[j]->cl_NextRun)
+			++j;
+		if (Heap[i]->cl_NextRun <= Heap[j]->cl_NextRun)
+			break;
+		HeapSwap(i, j);
+		i = j;
+	}
+}
@@ -0,0 +1,517 @@
+/*
+ * SNAPSHOT.C
+ *
+ * With -p, the parsed crontabs, and the stamps we know, are saved to
+ * TSDir/SNAPFILE after they're (re)loaded and when we're stopped.  At
+ * startup it's mapped, and each crontab in it that is still the file it
+ * was parsed from, going by its stat signature, is loaded from it rather
+ * than parsed.  SynchronizeDir then finds those unchanged, and only parses
+ * what's new or changed.
+ *
+ * The snapshot is in our own native layout; one from a crond with another
+ * layout is just not used.
+ *
+ * May be distributed under the GNU General Public License version 2 or any later version.
+ */
+
+#include <sys/mman.h>
+
+#include "defs.h"
+
+Prototype void LoadSnapshot(void);
+Prototype void SaveSnapshot(void);
+
+#define SNAP_MAGIC		"dcronsnp"
+#define SNAP_VERSION	1
+
+typedef struct SnapHead {
+	char	sh_Magic[8];
+	uint32_t sh_Version;
+	uint32_t sh_FileSize;	/* sizeof(SnapFile) */
+	uint32_t sh_LineSize;	/* sizeof(SnapLine) */
+	uint32_t sh_StampSize;	/* sizeof(SnapStamp) */
+	uint32_t sh_NFiles;
+	uint32_t sh_NStamps;
+} SnapHead;
+
+/* followed by cf_DPath, cf_FileName and cf_UserName, then its lines */
+typedef struct SnapFile {
+	uint64_t sf_Len;		/* bytes to the next SnapFile */
+	int64_t	sf_Dev;
+	int64_t	sf_Ino;
+	int64_t	sf_Size;
+	int64_t	sf_Mtime[2];
+	int64_t	sf_Ctime[2];
+	uint32_t sf_NLines;
+	uint32_t sf_Pad;
+} SnapFile;
+
+/* followed by cl_Shell and cl_JobName (or ""), then per waiter its cw_MaxWait and cw_Name */
+typedef struct SnapLine {
+	uint64_t sl_Mins;
+	uint64_t sl_Dow;
+	int64_t	sl_MemMax;
+	uint32_t sl_Hrs;
+	uint32_t sl_Days;
+	int32_t	sl_Freq;
+	int32_t	sl_Delay;
+	int32_t	sl_Spread;
+	int32_t	sl_CpuWeight;
+	int32_t	sl_IoWeight;
+	int32_t	sl_Timeout;
+	uint16_t sl_Mons;
+	int16_t	sl_Overlap;
+	uint32_t sl_NWaiters;
+} SnapLine;
+
+/* followed by ks_Path */
+typedef struct SnapStamp {
+	int64_t	ss_LastRan;
+	int64_t	ss_NotUntil;
+	int64_t	ss_Ino;
+	int64_t	ss_Size;
+	int64_t	ss_Mtime[2];
+} SnapStamp;
+
+typedef struct SnapBuf {
+	char	*sb_Data;
+	size_t	sb_Len;
+	size_t	sb_Size;
+} SnapBuf;
+
+typedef struct SnapCur {
+	const char *sc_Ptr;
+	const char *sc_End;
+} SnapCur;
+
+void SnapPut(SnapBuf *sb, const void *data, size_t len);
+void SnapPutStr(SnapBuf *sb, const char *str);
+int SnapGet(SnapCur *sc, void *data, size_t len);
+const char *SnapGetStr(SnapCur *sc);
+CronFile *SnapLoadFile(SnapCur *sc, SnapFile *sf, const char *dpath, const char *fname, const char *user);
+
+/*
+ * LoadSnapshot() - load the crontabs in the snapshot that haven't changed
+ * since, and the stamps whose files haven't
+ */
+void
+LoadSnapshot(void)
+{
+	char *path = concat(TSDir, "/", SNAPFILE, NULL);
+	struct stat sbuf;
+	SnapHead sh;
+	SnapCur sc;
+	char *map;
+	uint32_t n;
+	int loaded = 0;
+	int fd;
+
+	if (!path) {
+		errno = ENOMEM;
+		perror("LoadSnapshot");
+		exit(1);
+	}
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0) {
+		if (errno != ENOENT)
+			printlogf(LOG_WARNING, "unable to read %s: %s\n", path, strerror(errno));
+		free(path);
+		return;
+	}
+	if (fstat(fd, &sbuf) < 0 || sbuf.st_size < sizeof(SnapHead) ||
+			(map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		printlogf(LOG_WARNING, "unable to read %s\n", path);
+		close(fd);
+		free(path);
+		return;
+	}
+	close(fd);
+
+	sc.sc_Ptr = map;
+	sc.sc_End = map + sbuf.st_size;
+	SnapGet(&sc, &sh, sizeof(sh));
+	if (memcmp(sh.sh_Magic, SNAP_MAGIC, sizeof(sh.sh_Magic)) != 0 ||
+			sh.sh_Version != SNAP_VERSION ||
+			sh.sh_FileSize != sizeof(SnapFile) ||
+			sh.sh_LineSize != sizeof(SnapLine) ||
+			sh.sh_StampSize != sizeof(SnapStamp)
+	   ) {
+		printlogf(LOG_NOTICE, "%s is from another version of crond, not using it\n", path);
+		munmap(map, sbuf.st_size);
+		free(path);
+		return;
+	}
+
+	for (n = 0; n < sh.sh_NFiles; ++n) {
+		const char *start = sc.sc_Ptr;
+		const char *dpath, *fname, *user;
+		SnapFile sf;
+		SnapCur fc;
+		char *fpath;
+		struct stat fbuf;
+
+		if (SnapGet(&sc, &sf, sizeof(sf)) < 0 || sf.sf_Len > sc.sc_End - start)
+			break;
+		fc = sc;
+		sc.sc_Ptr = start + sf.sf_Len;
+		if (!(dpath = SnapGetStr(&fc)) || !(fname = SnapGetStr(&fc)) || !(user = SnapGetStr(&fc)))
+			break;
+		/* only from the directories we read now, and as we'd read it */
+		if (strcmp(dpath, CDir) == 0) {
+			if (strcmp(user, fname) != 0)
+				continue;
+		} else if (strcmp(dpath, SCDir) != 0 || strcmp(user, "root") != 0)
+			continue;
+		if (!(fpath = concat(dpath, "/", fname, NULL))) {
+			errno = ENOMEM;
+			perror("LoadSnapshot");
+			exit(1);
+		}
+		if (stat(fpath, &fbuf) == 0 && fbuf.st_uid == DaemonUid &&
+				fbuf.st_dev == sf.sf_Dev && fbuf.st_ino == sf.sf_Ino &&
+				fbuf.st_size == sf.sf_Size &&
+				fbuf.st_mtim.tv_sec == sf.sf_Mtime[0] && fbuf.st_mtim.tv_nsec == sf.sf_Mtime[1] &&
+				fbuf.st_ctim.tv_sec == sf.sf_Ctime[0] && fbuf.st_ctim.tv_nsec == sf.sf_Ctime[1] &&
+				!FindFile(dpath, fname)
+		   ) {
+			CronFile *file;
+
+			if ((file = SnapLoadFile(&fc, &sf, dpath, fname, user)) != NULL) {
+				LinkFile(file);
+				++loaded;
+			}
+		}
+		free(fpath);
+	}
+
+	/* jump to the stamps: they follow the last file */
+	for (n = 0; n < sh.sh_NStamps && sc.sc_Ptr < sc.sc_End; ++n) {
+		SnapStamp ss;
+		const char *spath;
+		struct stat fbuf;
+
+		if (SnapGet(&sc, &ss, sizeof(ss)) < 0 || !(spath = SnapGetStr(&sc)))
+			break;
+		/* one kept by -k may have changed unseen, but a text stamp can't */
+		if (ss.ss_Ino && stat(spath, &fbuf) == 0 &&
+				fbuf.st_ino == ss.ss_Ino && fbuf.st_size == ss.ss_Size &&
+				fbuf.st_mtim.tv_sec == ss.ss_Mtime[0] && fbuf.st_mtim.tv_nsec == ss.ss_Mtime[1])
+			KnowStamp(spath, ss.ss_LastRan, ss.ss_NotUntil, &fbuf);
+	}
+
+	printlogf(LOG_INFO, "loaded %d of %u crontabs from %s\n", loaded, sh.sh_NFiles, path);
+	munmap(map, sbuf.st_size);
+	free(path);
+	SnapshotDirty = (loaded < sh.sh_NFiles);
+}
+
+/*
+ * SnapLoadFile() - a CronFile from its snapshot, which sc is just after
+ * the names of; NULL if the snapshot is cut short
+ */
+CronFile *
+SnapLoadFile(SnapCur *sc, SnapFile *sf, const char *dpath, const char *fname, const char *user)
+{
+	CronFile *file = calloc(1, sizeof(CronFile));
+	CronLine **pline;
+	time_t tnow = time(NULL);
+	uint32_t n, w;
+
+	tnow -= tnow % 60;
+	if (!file || !(file->cf_UserName = strdup(user)) || !(file->cf_FileName = strdup(fname)) ||
+			!(file->cf_DPath = strdup(dpath))) {
+		errno = ENOMEM;
+		perror("SnapLoadFile");
+		exit(1);
+	}
+	file->cf_Dev = sf->sf_Dev;
+	file->cf_Ino = sf->sf_Ino;
+	file->cf_Size = sf->sf_Size;
+	file->cf_Mtime.tv_sec = sf->sf_Mtime[0];
+	file->cf_Mtime.tv_nsec = sf->sf_Mtime[1];
+	file->cf_Ctime.tv_sec = sf->sf_Ctime[0];
+	file->cf_Ctime.tv_nsec = sf->sf_Ctime[1];
+	file->cf_Seen = 1;
+	pline = &file->cf_LineBase;
+
+	for (n = 0; n < sf->sf_NLines; ++n) {
+		CronLine *line;
+		CronWaiter **pwaiter;
+		const char *shell, *job;
+		SnapLine sl;
+
+		if (SnapGet(sc, &sl, sizeof(sl)) < 0 || !(shell = SnapGetStr(sc)) || !(job = SnapGetStr(sc)))
+			break;
+		if (!(line = calloc(1, sizeof(CronLine))) || !(line->cl_Shell = strdup(shell))) {
+			errno = ENOMEM;
+			perror("SnapLoadFile");
+			exit(1);
+		}
+		line->cl_Mins = sl.sl_Mins;
+		line->cl_Dow = sl.sl_Dow;
+		line->cl_MemMax = sl.sl_MemMax;
+		line->cl_Hrs = sl.sl_Hrs;
+		line->cl_Days = sl.sl_Days;
+		line->cl_Mons = sl.sl_Mons;
+		line->cl_Freq = sl.sl_Freq;
+		line->cl_Delay = sl.sl_Delay;
+		line->cl_Spread = sl.sl_Spread;
+		line->cl_CpuWeight = sl.sl_CpuWeight;
+		line->cl_IoWeight = sl.sl_IoWeight;
+		line->cl_Timeout = sl.sl_Timeout;
+		line->cl_Overlap = sl.sl_Overlap;
+		if (*job) {
+			if (!(line->cl_Description = concat("job ", job, NULL))) {
+				errno = ENOMEM;
+				perror("SnapLoadFile");
+				exit(1);
+			}
+			line->cl_JobName = line->cl_Description + 4;
+		} else
+			line->cl_Description = line->cl_Shell;
+		if (line->cl_Delay > 0) {
+			if (!(line->cl_Timestamp = concat(TSDir, "/", user, ".", job, NULL))) {
+				errno = ENOMEM;
+				perror("SnapLoadFile");
+				exit(1);
+			}
+			line->cl_NotUntil = tnow + line->cl_Delay;
+		}
+
+		pwaiter = &line->cl_Waiters;
+		for (w = 0; w < sl.sl_NWaiters; ++w) {
+			CronWaiter *waiter;
+			int32_t maxWait;
+			const char *name;
+
+			if (SnapGet(sc, &maxWait, sizeof(maxWait)) < 0 || !(name = SnapGetStr(sc)))
+				break;
+			if (!(waiter = calloc(1, sizeof(CronWaiter))) || !(waiter->cw_Name = strdup(name))) {
+				errno = ENOMEM;
+				perror("SnapLoadFile");
+				exit(1);
+			}
+			waiter->cw_Flag = -1;
+			waiter->cw_MaxWait = maxWait;
+			*pwaiter = waiter;
+			pwaiter = &waiter->cw_Next;
+		}
+
+		/* the first job with a name is the one AFTER= and prodding find */
+		if (line->cl_JobName && !FindJob(file, line->cl_JobName))
+			HashAdd(&file->cf_Jobs, HashString(HASH_INIT, line->cl_JobName), line);
+		*pline = line;
+		pline = &line->cl_Next;
+	}
+	*pline = NULL;
+	if (n < sf->sf_NLines) {
+		/* not linked yet, so DeleteFile can't have it; the snapshot was cut short */
+		printlogf(LOG_WARNING, "snapshot of %s/%s is damaged, parsing it\n", dpath, fname);
+		while ((*pline = file->cf_LineBase) != NULL) {
+			CronWaiter *waiter;
+
+			file->cf_LineBase = (*pline)->cl_Next;
+			while ((waiter = (*pline)->cl_Waiters) != NULL) {
+				(*pline)->cl_Waiters = waiter->cw_Next;
+				free(waiter->cw_Name);
+				free(waiter);
+			}
+			if ((*pline)->cl_JobName)
+				free((*pline)->cl_Description);
+			free((*pline)->cl_Timestamp);
+			free((*pline)->cl_Shell);
+			free(*pline);
+		}
+		HashFree(&file->cf_Jobs);
+		free(file->cf_UserName);
+		free(file->cf_FileName);
+		free(file->cf_DPath);
+		free(file);
+		return(NULL);
+	}
+	return(file);
+}
+
+/*
+ * SaveSnapshot() - write the crontabs we have, and the stamps we know, to
+ * the snapshot
+ *
+ * It's written beside the old one and renamed over it, so a crash leaves
+ * one or the other.
+ */
+void
+SaveSnapshot(void)
+{
+	char *path = concat(TSDir, "/", SNAPFILE, NULL);
+	char *tmp = concat(TSDir, "/", SNAPFILE, ".new", NULL);
+	SnapBuf sb = { NULL, 0, 0 };
+	SnapHead sh;
+	CronFile *file;
+	CronLine *line;
+	CronWaiter *waiter;
+	unsigned long n;
+	int fd;
+
+	if (!path || !tmp) {
+		errno = ENOMEM;
+		perror("SaveSnapshot");
+		exit(1);
+	}
+	memset(&sh, 0, sizeof(sh));
+	memcpy(sh.sh_Magic, SNAP_MAGIC, sizeof(sh.sh_Magic));
+	sh.sh_Version = SNAP_VERSION;
+	sh.sh_FileSize = sizeof(SnapFile);
+	sh.sh_LineSize = sizeof(SnapLine);
+	sh.sh_StampSize = sizeof(SnapStamp);
+	SnapPut(&sb, &sh, sizeof(sh));
+
+	for (file = FileBase; file; file = file->cf_Next) {
+		size_t start = sb.sb_Len;
+		SnapFile sf;
+
+		if (file->cf_Deleted)
+			continue;
+		memset(&sf, 0, sizeof(sf));
+		sf.sf_Dev = file->cf_Dev;
+		sf.sf_Ino = file->cf_Ino;
+		sf.sf_Size = file->cf_Size;
+		sf.sf_Mtime[0] = file->cf_Mtime.tv_sec;
+		sf.sf_Mtime[1] = file->cf_Mtime.tv_nsec;
+		sf.sf_Ctime[0] = file->cf_Ctime.tv_sec;
+		sf.sf_Ctime[1] = file->cf_Ctime.tv_nsec;
+		for (line = file->cf_LineBase; line; line = line->cl_Next)
+			++sf.sf_NLines;
+		SnapPut(&sb, &sf, sizeof(sf));
+		SnapPutStr(&sb, file->cf_DPath);
+		SnapPutStr(&sb, file->cf_FileName);
+		SnapPutStr(&sb, file->cf_UserName);
+
+		for (line = file->cf_LineBase; line; line = line->cl_Next) {
+			SnapLine sl;
+
+			memset(&sl, 0, sizeof(sl));
+			sl.sl_Mins = line->cl_Mins;
+			sl.sl_Dow = line->cl_Dow;
+			sl.sl_MemMax = line->cl_MemMax;
+			sl.sl_Hrs = line->cl_Hrs;
+			sl.sl_Days = line->cl_Days;
+			sl.sl_Mons = line->cl_Mons;
+			sl.sl_Freq = line->cl_Freq;
+			sl.sl_Delay = line->cl_Delay;
+			sl.sl_Spread = line->cl_Spread;
+			sl.sl_CpuWeight = line->cl_CpuWeight;
+			sl.sl_IoWeight = line->cl_IoWeight;
+			sl.sl_Timeout = line->cl_Timeout;
+			sl.sl_Overlap = line->cl_Overlap;
+			for (waiter = line->cl_Waiters; waiter; waiter = waiter->cw_Next)
+				++sl.sl_NWaiters;
+			SnapPut(&sb, &sl, sizeof(sl));
+			SnapPutStr(&sb, line->cl_Shell);
+			SnapPutStr(&sb, line->cl_JobName ? line->cl_JobName : "");
+			for (waiter = line->cl_Waiters; waiter; waiter = waiter->cw_Next) {
+				int32_t maxWait = waiter->cw_MaxWait;
+				const char *name = waiter->cw_Name;
+
+				/* ResolveWaiters has dropped the names it found */
+				if (!name)
+					name = waiter->cw_NotifLine ? waiter->cw_NotifLine->cl_JobName : "";
+				SnapPut(&sb, &maxWait, sizeof(maxWait));
+				SnapPutStr(&sb, name);
+			}
+		}
+		sf.sf_Len = sb.sb_Len - start;
+		memcpy(sb.sb_Data + start, &sf, sizeof(sf));
+		++sh.sh_NFiles;
+	}
+
+	for (n = 0; KnownStamps.ht_Buckets && n <= KnownStamps.ht_Mask; ++n) {
+		HashNode *hn;
+
+		for (hn = KnownStamps.ht_Buckets[n]; hn; hn = hn->hn_Next) {
+			KnownStamp *ks = hn->hn_Data;
+			SnapStamp ss;
+
+			memset(&ss, 0, sizeof(ss));
+			ss.ss_LastRan = ks->ks_LastRan;
+			ss.ss_NotUntil = ks->ks_NotUntil;
+			ss.ss_Ino = ks->ks_Ino;
+			ss.ss_Size = ks->ks_Size;
+			ss.ss_Mtime[0] = ks->ks_Mtime.tv_sec;
+			ss.ss_Mtime[1] = ks->ks_Mtime.tv_nsec;
+			SnapPut(&sb, &ss, sizeof(ss));
+			SnapPutStr(&sb, ks->ks_Path);
+			++sh.sh_NStamps;
+		}
+	}
+	memcpy(sb.sb_Data, &sh, sizeof(sh));
+
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600)) < 0 ||
+			write(fd, sb.sb_Data, sb.sb_Len) != sb.sb_Len ||
+			fsync(fd) < 0 ||
+			rename(tmp, path) < 0
+	   ) {
+		printlogf(LOG_WARNING, "unable to write %s: %s\n", path, strerror(errno));
+		remove(tmp);
+	} else {
+		SnapshotDirty = 0;
+		if (DebugOpt)
+			printlogf(LOG_DEBUG, "wrote %u crontabs and %u stamps to %s\n", sh.sh_NFiles, sh.sh_NStamps, path);
+	}
+	if (fd >= 0)
+		close(fd);
+	free(sb.sb_Data);
+	free(path);
+	free(tmp);
+}
+
+void
+SnapPut(SnapBuf *sb, const void *data, size_t len)
+{
+	if (sb->sb_Len + len > sb->sb_Size) {
+		size_t size = sb->sb_Size ? sb->sb_Size : 64 * 1024;
+
+		while (size < sb->sb_Len + len)
+			size *= 2;
+		if (!(sb->sb_Data = realloc(sb->sb_Data, size))) {
+			errno = ENOMEM;
+			perror("SnapPut");
+			exit(1);
+		}
+		sb->sb_Size = size;
+	}
+	memcpy(sb->sb_Data + sb->sb_Len, data, len);
+	sb->sb_Len += len;
+}
+
+void
+SnapPutStr(SnapBuf *sb, const char *str)
+{
+	SnapPut(sb, str, strlen(str) + 1);
+}
+
+/*
+ * SnapGet() - copy out the next len bytes; -1 if there aren't that many
+ */
+int
+SnapGet(SnapCur *sc, void *data, size_t len)
+{
+	if (sc->sc_End - sc->sc_Ptr < len)
+		return(-1);
+	memcpy(data, sc->sc_Ptr, len);
+	sc->sc_Ptr += len;
+	return(0);
+}
+
+/*
+ * SnapGetStr() - the next string, in place; NULL if it isn't terminated
+ */
+const char *
+SnapGetStr(SnapCur *sc)
+{
+	const char *str = sc->sc_Ptr;
+	const char *end = memchr(str, 0, sc->sc_End - str);
+
+	if (!end)
+		return(NULL);
+	sc->sc_Ptr = end + 1;
+	return(str);
+}
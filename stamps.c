@@ -0,0 +1,226 @@
+/*
+ * STAMPS.C
+ *
+ * With -k, timestamps are kept in one file, TSDir/STAMPFILE, of fixed-size
+ * binary records, instead of a "user.job" text file per job.  It's mapped
+ * shared, so a stamp is read and updated in place, and a job we haven't
+ * seen before gets a record at the end.  A text stamp found for a job is
+ * taken into the store, and removed.
+ *
+ * May be distributed under the GNU General Public License version 2 or any later version.
+ */
+
+#include <sys/mman.h>
+
+#include "defs.h"
+
+Prototype void StampInit(void);
+Prototype int StampGet(const char *user, const char *job, time_t *lastRan, time_t *notUntil);
+Prototype int StampPut(const char *user, const char *job, time_t lastRan, time_t notUntil, int exit_status);
+Prototype void StampSync(void);
+
+#define STAMP_MAGIC		"dcronstm"
+#define STAMP_VERSION	1
+#define STAMP_KEYLEN	96		/* "user.job", with its terminating 0 */
+#define STAMP_GROW		256		/* records the file grows by */
+
+typedef struct StampHead {
+	char	sh_Magic[8];
+	uint32_t sh_Version;
+	uint32_t sh_RecSize;	/* sizeof(StampRec) */
+	uint32_t sh_Count;		/* records in use */
+	char	sh_Pad[108];	/* to sizeof(StampRec) */
+} StampHead;
+
+typedef struct StampRec {
+	char	sr_Key[STAMP_KEYLEN];
+	int64_t	sr_LastRan;		/* or 0, for only "after sr_NotUntil" */
+	int64_t	sr_NotUntil;
+	int32_t	sr_Exit;		/* of the last run */
+	char	sr_Spare[12];	/* to 128 bytes */
+} StampRec;
+
+int StampKey(char *key, const char *user, const char *job);
+StampRec *StampFind(const char *key);
+
+StampHead *StampMap = NULL;	/* the whole store, or NULL without -k */
+StampRec *StampRecs;		/* its records, after the head */
+uint32_t StampCap;			/* records the file has room for */
+int StampFd = -1;
+short StampDirty = 0;		/* changed since StampSync() */
+HashTable StampIndex;		/* StampRecs, by sr_Key */
+
+/*
+ * StampInit() - open and map the store, making it if it's not there
+ *
+ * The mapping is made for STAMP_MAXRECS records up front, so records never
+ * move as the file grows.  If the store can't be used, this is logged and
+ * stamps are kept in text files as without -k.
+ */
+void
+StampInit(void)
+{
+	char *path = concat(TSDir, "/", STAMPFILE, NULL);
+	size_t maplen = sizeof(StampHead) + (size_t)STAMP_MAXRECS * sizeof(StampRec);
+	struct stat sbuf;
+	StampHead *sh;
+	uint32_t n;
+	int fd;
+
+	if (!path) {
+		errno = ENOMEM;
+		perror("StampInit");
+		exit(1);
+	}
+	if ((fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) < 0 || fstat(fd, &sbuf) < 0) {
+		printlogf(LOG_ERR, "unable to open %s, using text timestamps: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	if (sbuf.st_size == 0 && ftruncate(fd, sizeof(StampHead) + STAMP_GROW * sizeof(StampRec)) < 0) {
+		printlogf(LOG_ERR, "unable to size %s, using text timestamps: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	if (sbuf.st_size != 0 && sbuf.st_size < sizeof(StampHead)) {
+		/* leave it be for someone to look at */
+		printlogf(LOG_ERR, "%s isn't a timestamp store we can use, using text timestamps\n", path);
+		goto fail;
+	}
+	if ((sh = mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		printlogf(LOG_ERR, "unable to map %s, using text timestamps: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	if (sbuf.st_size == 0) {
+		memcpy(sh->sh_Magic, STAMP_MAGIC, sizeof(sh->sh_Magic));
+		sh->sh_Version = STAMP_VERSION;
+		sh->sh_RecSize = sizeof(StampRec);
+		sh->sh_Count = 0;
+		sbuf.st_size = sizeof(StampHead) + STAMP_GROW * sizeof(StampRec);
+	}
+	StampCap = (sbuf.st_size - sizeof(StampHead)) / sizeof(StampRec);
+	if (memcmp(sh->sh_Magic, STAMP_MAGIC, sizeof(sh->sh_Magic)) != 0 ||
+			sh->sh_Version != STAMP_VERSION ||
+			sh->sh_RecSize != sizeof(StampRec) ||
+			sh->sh_Count > StampCap || StampCap > STAMP_MAXRECS
+	   ) {
+		/* leave it be for someone to look at */
+		printlogf(LOG_ERR, "%s isn't a timestamp store we can use, using text timestamps\n", path);
+		munmap(sh, maplen);
+		goto fail;
+	}
+
+	StampMap = sh;
+	StampRecs = (StampRec *)(sh + 1);
+	StampFd = fd;
+	for (n = 0; n < sh->sh_Count; ++n) {
+		StampRecs[n].sr_Key[STAMP_KEYLEN - 1] = 0;
+		HashAdd(&StampIndex, HashString(HASH_INIT, StampRecs[n].sr_Key), &StampRecs[n]);
+	}
+	printlogf(LOG_INFO, "keeping timestamps in %s (%u jobs)\n", path, sh->sh_Count);
+	free(path);
+	return;
+fail:
+	if (fd >= 0)
+		close(fd);
+	free(path);
+}
+
+/*
+ * StampGet() - user's job's stamp from the store
+ *
+ * Returns 1 with *lastRan and *notUntil set, or 0 if the store has none.
+ */
+int
+StampGet(const char *user, const char *job, time_t *lastRan, time_t *notUntil)
+{
+	char key[STAMP_KEYLEN];
+	StampRec *sr;
+
+	if (!StampMap || StampKey(key, user, job) < 0 || !(sr = StampFind(key)))
+		return(0);
+	*lastRan = sr->sr_LastRan;
+	*notUntil = sr->sr_NotUntil;
+	return(1);
+}
+
+/*
+ * StampPut() - store user's job's stamp, in place or as a new record
+ *
+ * Returns 0, or -1 if it can't go in the store and wants a text file.
+ */
+int
+StampPut(const char *user, const char *job, time_t lastRan, time_t notUntil, int exit_status)
+{
+	char key[STAMP_KEYLEN];
+	StampRec *sr;
+
+	if (!StampMap || StampKey(key, user, job) < 0)
+		return(-1);
+	if (!(sr = StampFind(key))) {
+		if (StampMap->sh_Count == StampCap) {
+			uint32_t cap = StampCap + STAMP_GROW;
+
+			if (cap > STAMP_MAXRECS)
+				cap = STAMP_MAXRECS;
+			if (cap == StampCap || ftruncate(StampFd, sizeof(StampHead) + (off_t)cap * sizeof(StampRec)) < 0) {
+				printlogf(LOG_WARNING, "timestamp store full, using a text timestamp (user %s job %s)\n", user, job);
+				return(-1);
+			}
+			StampCap = cap;
+		}
+		sr = &StampRecs[StampMap->sh_Count];
+		memset(sr, 0, sizeof(StampRec));
+		strcpy(sr->sr_Key, key);
+		HashAdd(&StampIndex, HashString(HASH_INIT, key), sr);
+		++StampMap->sh_Count;
+	}
+	sr->sr_LastRan = lastRan;
+	sr->sr_NotUntil = notUntil;
+	sr->sr_Exit = exit_status;
+	StampDirty = 1;
+	return(0);
+}
+
+/*
+ * StampSync() - put what's changed in the store on disk
+ *
+ * Records are 128 bytes, aligned, so each lies within a disk sector and
+ * is written whole.
+ */
+void
+StampSync(void)
+{
+	if (!StampMap || !StampDirty)
+		return;
+	if (msync(StampMap, sizeof(StampHead) + (size_t)StampCap * sizeof(StampRec), MS_SYNC) < 0)
+		printlogf(LOG_WARNING, "unable to sync timestamp store: %s\n", strerror(errno));
+	StampDirty = 0;
+}
+
+/*
+ * StampKey() - "user.job" in key, or -1 if it's too long for a record
+ */
+int
+StampKey(char *key, const char *user, const char *job)
+{
+	size_t ulen = strlen(user);
+	size_t jlen = strlen(job);
+
+	if (ulen + 1 + jlen >= STAMP_KEYLEN)
+		return(-1);
+	memcpy(key, user, ulen);
+	key[ulen] = '.';
+	memcpy(key + ulen + 1, job, jlen + 1);
+	return(0);
+}
+
+StampRec *
+StampFind(const char *key)
+{
+	HashNode *hn;
+
+	for (hn = HashFirst(&StampIndex, HashString(HASH_INIT, key)); hn; hn = HashNext(hn)) {
+		if (strcmp(((StampRec *)hn->hn_Data)->sr_Key, key) == 0)
+			return(hn->hn_Data);
+	}
+	return(NULL);
+}
@@ -0,0 +1,131 @@
+/*
+ * STATS.C
+ *
+ * What each job used, from wait4(): its wall time, user and system CPU
+ * time, maximum RSS and exit status are logged when it ends, and kept per
+ * CronLine along with a count, mean, p95 and maximum of its wall time
+ * over its recent runs.
+ *
+ * May be distributed under the GNU General Public License version 2 or any later version.
+ */
+
+#include "defs.h"
+
+Prototype void StartStats(CronLine *line);
+Prototype void RecordStats(CronFile *file, CronLine *line, int status, struct rusage *ru);
+Prototype void FreeStats(CronLine *line);
+
+typedef struct JobStats {
+	/* the last run */
+	time_t	js_Start;
+	int64_t	js_Wall;		/* microseconds */
+	int64_t	js_User;
+	int64_t	js_Sys;
+	long	js_MaxRss;		/* kB */
+	int		js_Status;		/* from wait4() */
+	/* all runs since the line was loaded */
+	unsigned long js_Count;
+	int64_t	js_WallSum;
+	int64_t	js_WallMax;
+	long	js_RssMax;
+	/* the last STATS_SAMPLES wall times, for the p95 */
+	int64_t	js_Samples[STATS_SAMPLES];
+} JobStats;
+
+int64_t Percentile(JobStats *js, int pct);
+int CompareUsec(const void *a, const void *b);
+
+/*
+ * StartStats() - note when line's job was started
+ */
+void
+StartStats(CronLine *line)
+{
+	if (!line->cl_Stats && !(line->cl_Stats = calloc(1, sizeof(JobStats)))) {
+		errno = ENOMEM;
+		perror("StartStats");
+		exit(1);
+	}
+	line->cl_Stats->js_Start = time(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &line->cl_Started);
+}
+
+/*
+ * RecordStats() - line's job was reaped with status and ru: log what it
+ * used, and add it to the line's totals
+ */
+void
+RecordStats(CronFile *file, CronLine *line, int status, struct rusage *ru)
+{
+	JobStats *js = line->cl_Stats;
+	struct timespec now;
+	char how[32];
+	int64_t mean, p95;
+
+	if (!js)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	js->js_Wall = (int64_t)(now.tv_sec - line->cl_Started.tv_sec) * 1000000 +
+		(now.tv_nsec - line->cl_Started.tv_nsec) / 1000;
+	js->js_User = (int64_t)ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec;
+	js->js_Sys = (int64_t)ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec;
+	js->js_MaxRss = ru->ru_maxrss;
+	js->js_Status = status;
+
+	js->js_Samples[js->js_Count % STATS_SAMPLES] = js->js_Wall;
+	++js->js_Count;
+	js->js_WallSum += js->js_Wall;
+	if (js->js_Wall > js->js_WallMax)
+		js->js_WallMax = js->js_Wall;
+	if (js->js_MaxRss > js->js_RssMax)
+		js->js_RssMax = js->js_MaxRss;
+	mean = js->js_WallSum / (int64_t)js->js_Count;
+	p95 = Percentile(js, 95);
+
+	if (WIFSIGNALED(status))
+		snprintf(how, sizeof(how), "signal %d", WTERMSIG(status));
+	else
+		snprintf(how, sizeof(how), "exit status %d", WEXITSTATUS(status));
+	printlogf(LOG_INFO, "ran %lld.%03llds (user %lld.%03llds sys %lld.%03llds), max rss %ld kB, %s; "
+			"%lu runs, mean %lld.%03llds p95 %lld.%03llds max %lld.%03llds: user %s %s\n",
+			(long long)(js->js_Wall / 1000000), (long long)(js->js_Wall / 1000 % 1000),
+			(long long)(js->js_User / 1000000), (long long)(js->js_User / 1000 % 1000),
+			(long long)(js->js_Sys / 1000000), (long long)(js->js_Sys / 1000 % 1000),
+			js->js_MaxRss, how, js->js_Count,
+			(long long)(mean / 1000000), (long long)(mean / 1000 % 1000),
+			(long long)(p95 / 1000000), (long long)(p95 / 1000 % 1000),
+			(long long)(js->js_WallMax / 1000000), (long long)(js->js_WallMax / 1000 % 1000),
+			file->cf_UserName, line->cl_Description);
+}
+
+void
+FreeStats(CronLine *line)
+{
+	free(line->cl_Stats);
+	line->cl_Stats = NULL;
+}
+
+/*
+ * Percentile() - the pct'th percentile of js's sampled wall times
+ */
+int64_t
+Percentile(JobStats *js, int pct)
+{
+	int64_t sorted[STATS_SAMPLES];
+	int n = (js->js_Count < STATS_SAMPLES) ? (int)js->js_Count : STATS_SAMPLES;
+
+	if (n == 0)
+		return(0);
+	memcpy(sorted, js->js_Samples, n * sizeof(int64_t));
+	qsort(sorted, n, sizeof(int64_t), CompareUsec);
+	return(sorted[(n * pct + 99) / 100 - 1]);
+}
+
+int
+CompareUsec(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+
+	return((x > y) - (x < y));
+}
@@ -13,11 +13,14 @@ Prototype void printlogf(int level, const char *ctl, ...);
 Prototype void fdprintlogf(int level, int fd, const char *ctl, ...);
 Prototype void fdprintf(int fd, const char *ctl, ...);
 Prototype void initsignals(void);
+Prototype int openchildfd(void);
+Prototype void unblocksignals(void);
 Prototype char Hostname[SMALL_BUFFER];
 
 void vlog(int level, int fd, const char *ctl, va_list va);
 
 char Hostname[SMALL_BUFFER];
+pthread_mutex_t LogLock = PTHREAD_MUTEX_INITIALIZER;	/* crontabs are parsed, and log, in several threads */
 
 
 void
@@ -59,10 +62,11 @@ vlog(int level, int fd, const char *ctl, va_list va)
 	static short suppressHeader = 0;
 
 	if (level <= LogLevel) {
+		pthread_mutex_lock(&LogLock);
 		if (ForegroundOpt) {
 			/*
 			 * when -d or -f, we always (and only) log to stderr
-			 * fd will be 2 except when 2 is bound to a execing subprocess, then it will be 8
+			 * fd is 2, or whatever descriptor fdprintlogf was given
 			 * [v]snprintf write at most size including \0; they'll null-terminate, even when they truncate
 			 * we don't care here whether it truncates
 			 */
@@ -107,6 +111,7 @@ vlog(int level, int fd, const char *ctl, va_list va)
 			suppressHeader = (buf[buflen-1] != '\n');
 
 		}
+		pthread_mutex_unlock(&LogLock);
 	}
 }
 
@@ -123,24 +128,10 @@ void reopenlogger(int sig) {
 	}
 }
 
-void waitmailjob(int sig) {
-	/*
-	 * Wait for any children in our process group.
-	 * These will all be mailjobs.
-	 */
-	pid_t child;
-	do {
-		child = waitpid(-DaemonPid, NULL, WNOHANG);
-		/* call was interrupted, try again: won't happen because we use SA_RESTART */
-		/* if (child == (pid_t)-1 && errno == EINTR) continue; */
-	} while (child > (pid_t) 0);
-	/* if no pending children, child,errno == -1,ECHILD */
-	/* if all children still running, child == 0 */
-}
-
 void
 initsignals (void) {
 	struct sigaction sa;
+	sigset_t mask;
 	int n;
 
 	/* save daemon's pid globally */
@@ -157,9 +148,20 @@ initsignals (void) {
 		fdprintf(2, "failed to start SIGHUP handling, reason: %s", strerror(errno));
 		exit(n);
 	}
-	sa.sa_flags = SA_RESTART;
-	sa.sa_handler = waitmailjob;
-	if (sigaction (SIGCHLD, &sa, NULL) != 0) {
+
+	/*
+	 * SIGCHLD stays blocked and is read from a signalfd by the main loop
+	 * (see openchildfd), which reaps jobs and mailjobs alike.  So do
+	 * SIGTERM and SIGINT, so we stop between wakeups, with what we keep
+	 * on disk up to date.
+	 */
+	sa.sa_flags = 0;
+	sa.sa_handler = SIG_DFL;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	if (sigaction (SIGCHLD, &sa, NULL) != 0 || sigprocmask(SIG_BLOCK, &mask, NULL) != 0) {
 		n = errno;
 		fdprintf(2, "failed to start SIGCHLD handling, reason: %s", strerror(errno));
 		exit(n);
@@ -167,3 +169,38 @@ initsignals (void) {
 
 }
 
+/*
+ * openchildfd() - return a descriptor that polls readable when a child
+ * exits, or we're told to stop
+ *
+ * Called after initsignals(), once the daemon is done closing descriptors.
+ */
+int
+openchildfd(void)
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	if ((fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC)) < 0) {
+		perror("signalfd");
+		exit(1);
+	}
+	return(fd);
+}
+
+/*
+ * unblocksignals() - children don't inherit our blocked signals
+ */
+void
+unblocksignals(void)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
@@ -0,0 +1,324 @@
+/*
+ * SCHED_TEST.C
+ *
+ * Checks of sched.c's heap against a clock that jumps, and of NextFireTime()
+ * against a scan of every minute.  Built and run by `make test`; exits
+ * nonzero if a check fails.
+ *
+ * May be distributed under the GNU General Public License version 2 or any later version.
+ */
+
+#include "../defs.h"
+
+CronFile *FileBase = NULL;
+
+int Failures = 0;
+
+void Check(const char *what, time_t got, time_t want);
+CronLine *EveryMinute(CronFile *file);
+CronLine *NewLine(uint64_t mins, uint32_t hrs, uint32_t days, uint16_t mons, int wdays, char nth);
+void Zone(const char *tz);
+time_t Local(int y, int mon, int mday, int hour, int min);
+int Matches(CronLine *line, time_t t);
+time_t ScanNext(CronLine *line, time_t after, time_t limit);
+void Compare(const char *what, CronLine *line, time_t from, int runs, long span);
+void CompareKey(const char *what, CronLine *line, time_t after);
+
+void
+Check(const char *what, time_t got, time_t want)
+{
+	if (got != want) {
+		fprintf(stderr, "FAIL %s: got %ld, want %ld\n", what, (long)got, (long)want);
+		++Failures;
+	} else
+		printf("ok   %s\n", what);
+}
+
+CronLine *
+EveryMinute(CronFile *file)
+{
+	CronLine *line = calloc(1, sizeof(CronLine));
+	int wday;
+
+	line->cl_Mins = ALL_MINUTES;
+	line->cl_Hrs = ALL_HOURS;
+	line->cl_Days = ALL_M_DAYS;
+	line->cl_Mons = ALL_MONTHS;
+	for (wday = 0; wday < FIELD_W_DAYS; ++wday)
+		line->cl_Dow |= (uint64_t)ALL_DOW << (8 * wday);
+	line->cl_File = file;
+	line->cl_Next = file->cf_LineBase;
+	file->cf_LineBase = line;
+	return(line);
+}
+
+/*
+ * NewLine() - a line that isn't in any file, firing on the minutes, hours,
+ * days and months given, on the weekdays in wdays, on their nth (a mask of
+ * FIRST_DOW..LAST_DOW) occurrence in the month
+ */
+CronLine *
+NewLine(uint64_t mins, uint32_t hrs, uint32_t days, uint16_t mons, int wdays, char nth)
+{
+	CronLine *line = calloc(1, sizeof(CronLine));
+	int wday;
+
+	line->cl_Mins = mins;
+	line->cl_Hrs = hrs;
+	line->cl_Days = days;
+	line->cl_Mons = mons;
+	for (wday = 0; wday < FIELD_W_DAYS; ++wday)
+		if (wdays & (1 << wday))
+			line->cl_Dow |= (uint64_t)(unsigned char)nth << (8 * wday);
+	return(line);
+}
+
+/*
+ * Zone() - switch to time zone tz, and drop the days cached in the old one
+ */
+void
+Zone(const char *tz)
+{
+	setenv("TZ", tz, 1);
+	tzset();
+	FlushCalendar();
+}
+
+/*
+ * Local() - the local time given, mon 1-12
+ */
+time_t
+Local(int y, int mon, int mday, int hour, int min)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = y - 1900;
+	tm.tm_mon = mon - 1;
+	tm.tm_mday = mday;
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_isdst = -1;
+	return(mktime(&tm));
+}
+
+/*
+ * Matches() - does minute t match line, going by localtime() alone?
+ */
+int
+Matches(CronLine *line, time_t t)
+{
+	struct tm tm = *localtime(&t);
+	struct tm week = tm;
+	char nth = 1 << ((tm.tm_mday - 1) / 7);
+
+	/* in the month's last week if a week on is in another month */
+	week.tm_mday += 7;
+	week.tm_hour = 12;
+	week.tm_isdst = -1;
+	mktime(&week);
+	if (week.tm_mon != tm.tm_mon)
+		nth |= LAST_DOW;
+
+	return((line->cl_Mins & ((uint64_t)1 << tm.tm_min)) &&
+			(line->cl_Hrs & ((uint32_t)1 << tm.tm_hour)) &&
+			(line->cl_Days & ((uint32_t)1 << tm.tm_mday)) &&
+			(line->cl_Mons & (1 << tm.tm_mon)) &&
+			(DOW_BITS(line, tm.tm_wday) & nth));
+}
+
+/*
+ * ScanNext() - the first minute > after and <= limit that matches line,
+ * trying each in turn, or -1
+ */
+time_t
+ScanNext(CronLine *line, time_t after, time_t limit)
+{
+	time_t t;
+
+	for (t = after - after % 60 + 60; t <= limit; t += 60)
+		if (Matches(line, t))
+			return(t);
+	return((time_t)-1);
+}
+
+/*
+ * Compare() - check that NextFireTime() gives line's next runs from `from'
+ * as a scan does, each within span seconds of the last
+ */
+void
+Compare(const char *what, CronLine *line, time_t from, int runs, long span)
+{
+	time_t got = 0;
+	time_t want = 0;
+	time_t t = from;
+
+	while (runs-- > 0) {
+		got = NextFireTime(line, t);
+		want = ScanNext(line, t, t + span);
+		if (got > t + span)
+			got = (time_t)-1;
+		if (got != want || want == (time_t)-1)
+			break;
+		t = want;
+	}
+	if (want == (time_t)-1) {
+		fprintf(stderr, "FAIL %s: no run within %ld seconds of %ld\n", what, span, (long)t);
+		++Failures;
+	} else
+		Check(what, got, want);
+}
+
+/*
+ * CompareKey() - check the heap key ScheduleLine() gives line, scheduled
+ * after `after', against a scan: it waits for cl_NotUntil with FREQ=, and
+ * fires cl_Spread seconds after its minute
+ */
+void
+CompareKey(const char *what, CronLine *line, time_t after)
+{
+	time_t from = after - line->cl_Spread;
+	time_t want;
+
+	if (line->cl_Freq > 0 && from < line->cl_NotUntil - 60)
+		from = line->cl_NotUntil - 60;
+	want = ScanNext(line, from, from + 400 * 24 * 60 * 60);
+	ScheduleLine(line, after);
+	Check(what, line->cl_NextRun, want + line->cl_Spread);
+	UnscheduleLine(line);
+}
+
+int
+main(int ac, char **av)
+{
+	CronFile file;
+	time_t t0 = 1700000000 - 1700000000 % 60;	/* on a minute */
+	time_t back = t0 - 2 * 60 * 60 + 30;
+	time_t ahead = t0 + 3 * 60 * 60 + 30;
+
+	setenv("TZ", "UTC", 1);
+	tzset();
+	memset(&file, 0, sizeof(file));
+	FileBase = &file;
+	EveryMinute(&file);
+
+	SchedTime = t0;
+	ScheduleLine(file.cf_LineBase, SchedTime);
+	Check("every minute line queued for the next minute", NextScheduledTime(), t0 + 60);
+
+	/* the clock is stepped back two hours */
+	FlushCalendar();
+	RescheduleLines(back);
+	Check("after a step back, due the minute after the new time", NextScheduledTime(), back - back % 60 + 60);
+	Check("after a step back, tested from the new time", SchedTime, back);
+
+	/* and forward three */
+	FlushCalendar();
+	RescheduleLines(ahead);
+	Check("after a step forward, due the minute after the new time", NextScheduledTime(), ahead - ahead % 60 + 60);
+	UnscheduleLine(file.cf_LineBase);
+
+	/* clocks going forward skip 02:30, and going back repeat 01:30 */
+	Zone("America/New_York");
+	Compare("DST spring forward, 30 2 * * *",
+			NewLine(1ULL << 30, 1 << 2, ALL_M_DAYS, ALL_MONTHS, ALL_W_DAYS, ALL_DOW),
+			Local(2024, 3, 8, 0, 0), 5, 3 * 86400);
+	Compare("DST fall back, 30 1 * * *",
+			NewLine(1ULL << 30, 1 << 1, ALL_M_DAYS, ALL_MONTHS, ALL_W_DAYS, ALL_DOW),
+			Local(2024, 11, 1, 0, 0), 5, 3 * 86400);
+	Compare("DST spring forward, */15 * * * *",
+			NewLine(0x1000200040001ULL, ALL_HOURS, ALL_M_DAYS, ALL_MONTHS, ALL_W_DAYS, ALL_DOW),
+			Local(2024, 3, 9, 22, 0), 40, 86400);
+	Compare("DST fall back, */15 * * * *",
+			NewLine(0x1000200040001ULL, ALL_HOURS, ALL_M_DAYS, ALL_MONTHS, ALL_W_DAYS, ALL_DOW),
+			Local(2024, 11, 2, 22, 0), 40, 86400);
+	Compare("DST both ways, 59 1,2,3 * * *",
+			NewLine(1ULL << 59, 0xe, ALL_M_DAYS, ALL_MONTHS, ALL_W_DAYS, ALL_DOW),
+			Local(2024, 3, 1, 0, 0), 800, 3 * 86400);
+	Zone("Europe/London");
+	Compare("DST at 01:00 UTC, 30 1 * * *",
+			NewLine(1ULL << 30, 1 << 1, ALL_M_DAYS, ALL_MONTHS, ALL_W_DAYS, ALL_DOW),
+			Local(2024, 3, 29, 0, 0), 250, 3 * 86400);
+	/* a half hour change */
+	Zone("Australia/Lord_Howe");
+	Compare("half hour DST, */10 1,2 * * *",
+			NewLine(0x41041041041ULL, 0x6, ALL_M_DAYS, ALL_MONTHS, ALL_W_DAYS, ALL_DOW),
+			Local(2024, 4, 5, 0, 0), 40, 3 * 86400);
+	Compare("half hour DST, 45 1,2 * * *",
+			NewLine(1ULL << 45, 0x6, ALL_M_DAYS, ALL_MONTHS, ALL_W_DAYS, ALL_DOW),
+			Local(2024, 10, 4, 0, 0), 10, 3 * 86400);
+
+	/* days some months don't have */
+	Zone("UTC");
+	Compare("Feb 29, 0 0 29 2 *",
+			NewLine(1, 1, 1 << 29, 1 << 1, ALL_W_DAYS, ALL_DOW),
+			Local(2025, 1, 1, 0, 0), 2, 5 * 366 * 86400);
+	Compare("the 31st, 0 0 31 * *",
+			NewLine(1, 1, 1U << 31, ALL_MONTHS, ALL_W_DAYS, ALL_DOW),
+			Local(2024, 1, 1, 0, 0), 10, 62 * 86400);
+	Compare("the 31st of some months, 0 12 30,31 2,4,6,7 *",
+			NewLine(1, 1 << 12, 3U << 30, 0xd2, ALL_W_DAYS, ALL_DOW),
+			Local(2024, 1, 1, 0, 0), 10, 366 * 86400);
+	Check("Feb 30 never comes, 0 0 30 2 *",
+			NextFireTime(NewLine(1, 1, 1 << 30, 1 << 1, ALL_W_DAYS, ALL_DOW), Local(2024, 1, 1, 0, 0)),
+			(time_t)-1);
+
+	/* the nth weekday of the month: DoM 1-5 and a DoW, or DoM > 5 for the last */
+	Zone("America/New_York");
+	Compare("first Monday, 0 9 1 * mon",
+			NewLine(1, 1 << 9, ALL_M_DAYS, ALL_MONTHS, 1 << 1, FIRST_DOW),
+			Local(2024, 1, 1, 0, 0), 14, 40 * 86400);
+	Compare("fifth Friday, 0 9 5 * fri",
+			NewLine(1, 1 << 9, ALL_M_DAYS, ALL_MONTHS, 1 << 5, FIFTH_DOW),
+			Local(2024, 1, 1, 0, 0), 8, 200 * 86400);
+	Compare("last Sunday, 0 1 31 * sun",
+			NewLine(1, 1 << 1, ALL_M_DAYS, ALL_MONTHS, 1 << 0, LAST_DOW),
+			Local(2024, 1, 1, 0, 0), 14, 40 * 86400);
+	Compare("second and last Mon and Thu in Feb, 0 0 2,9 2 mon,thu",
+			NewLine(1, 1, ALL_M_DAYS, 1 << 1, (1 << 1) | (1 << 4), SECOND_DOW | LAST_DOW),
+			Local(2023, 1, 1, 0, 0), 12, 400 * 86400);
+
+	/*
+	 * DoM or DoW: with either one *, the other alone decides; NextFireTime
+	 * also takes both restricted at once, as the day must match both
+	 */
+	Compare("DoW only, 0 0 * * sat",
+			NewLine(1, 1, ALL_M_DAYS, ALL_MONTHS, 1 << 6, ALL_DOW),
+			Local(2024, 2, 20, 0, 0), 10, 8 * 86400);
+	Compare("DoM only, 0 0 1,15 * *",
+			NewLine(1, 1, (1 << 1) | (1 << 15), ALL_MONTHS, ALL_W_DAYS, ALL_DOW),
+			Local(2024, 2, 20, 0, 0), 10, 20 * 86400);
+	Compare("DoM and DoW both, Friday the 13th",
+			NewLine(1, 1, 1 << 13, ALL_MONTHS, 1 << 5, ALL_DOW),
+			Local(2024, 1, 1, 0, 0), 4, 430 * 86400);
+
+	/* SPREAD= keys fall after the month ends */
+	Zone("UTC");
+	{
+		CronLine *line = NewLine(1ULL << 58, 1 << 23, 1U << 31, ALL_MONTHS, ALL_W_DAYS, ALL_DOW);
+
+		line->cl_Spread = 300;
+		CompareKey("SPREAD=5m, before the month's last run", line, Local(2024, 1, 31, 23, 57));
+		CompareKey("SPREAD=5m, after the month's last minute, before its start", line, Local(2024, 2, 1, 0, 1));
+		CompareKey("SPREAD=5m, after the month's last run", line, Local(2024, 2, 1, 0, 4));
+	}
+
+	/* FREQ= lines wait for cl_NotUntil */
+	{
+		CronLine *line = NewLine(0x41041041041ULL, ALL_HOURS, ALL_M_DAYS, ALL_MONTHS, ALL_W_DAYS, ALL_DOW);
+		time_t t = Local(2024, 6, 1, 12, 0);
+
+		line->cl_Freq = 60 * 60;
+		line->cl_NotUntil = t + 5025;
+		CompareKey("FREQ=, waiting for cl_NotUntil", line, t);
+		line->cl_NotUntil = t + 3000;
+		CompareKey("FREQ=, cl_NotUntil on a run", line, t);
+		line->cl_NotUntil = t - 5000;
+		CompareKey("FREQ=, cl_NotUntil past", line, t);
+		line->cl_NotUntil = t + 5025;
+		line->cl_Spread = 90;
+		CompareKey("FREQ= and SPREAD=, waiting for cl_NotUntil", line, t);
+	}
+
+	return(Failures ? 1 : 0);
+}
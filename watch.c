@@ -0,0 +1,191 @@
+/*
+ * WATCH.C
+ *
+ * inotify watches on the crontab and timestamp directories, so a changed
+ * crontab or timestamp is reread as soon as it's written, and only that one.
+ *
+ * May be distributed under the GNU General Public License version 2 or any later version.
+ */
+
+#include "defs.h"
+
+Prototype int WatchDirs(void);
+Prototype int ReadWatches(int fd, time_t t1, time_t t2);
+Prototype int TSDirWd;
+
+#define WATCH_MASK	(IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE|IN_DELETE_SELF|IN_MOVE_SELF)
+
+/* the watched directory itself went away, or its watch did */
+#define WATCH_GONE	(IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT|IN_IGNORED)
+
+int AddWatches(int fd);
+void WatchedFile(const char *dpath, const char *user_override, struct inotify_event *ev, time_t t1, time_t t2);
+void WatchedStamp(struct inotify_event *ev);
+
+int CDirWd = -1;
+int SCDirWd = -1;
+int TSDirWd = -1;
+short WatchFailed = 0;		/* said so already; polling until we can watch again */
+
+/*
+ * WatchDirs() - start watching CDir, SCDir and TSDir
+ *
+ * Returns the inotify descriptor, or -1 if any of them can't be watched,
+ * in which case the caller goes on polling cron.update.  A caller that lost
+ * its watches may try again; it's only logged the first time.
+ */
+int
+WatchDirs(void)
+{
+	int fd;
+
+	if ((fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0) {
+		printlogf(LOG_NOTICE, "unable to use inotify, polling %s instead\n", CRONUPDATE);
+		return(-1);
+	}
+	if (AddWatches(fd) < 0) {
+		close(fd);
+		return(-1);
+	}
+	if (WatchFailed) {
+		printlogf(LOG_NOTICE, "watching %s, %s and %s again\n", CDir, SCDir, TSDir);
+		WatchFailed = 0;
+	}
+	return(fd);
+}
+
+/*
+ * AddWatches() - (re)watch CDir, SCDir and TSDir on fd, by path
+ *
+ * Any watches we had are dropped first: after a directory is moved, its
+ * watch follows it, not the path.  Returns -1, with none left, if any of
+ * them can't be watched.
+ */
+int
+AddWatches(int fd)
+{
+	if (CDirWd >= 0)
+		inotify_rm_watch(fd, CDirWd);
+	if (SCDirWd >= 0)
+		inotify_rm_watch(fd, SCDirWd);
+	if (TSDirWd >= 0)
+		inotify_rm_watch(fd, TSDirWd);
+	if ((CDirWd = inotify_add_watch(fd, CDir, WATCH_MASK)) < 0 ||
+			(SCDirWd = inotify_add_watch(fd, SCDir, WATCH_MASK)) < 0 ||
+			(TSDirWd = inotify_add_watch(fd, TSDir, WATCH_MASK)) < 0
+	   ) {
+		if (!WatchFailed)
+			printlogf(LOG_NOTICE, "unable to watch %s, %s and %s, polling %s instead\n",
+					CDir, SCDir, TSDir, CRONUPDATE);
+		WatchFailed = 1;
+		CDirWd = SCDirWd = TSDirWd = -1;
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * ReadWatches() - act on whatever has changed in the watched directories
+ *
+ * Returns nonzero if events were lost, and the directories must be rescanned:
+ * -1 if a directory's watch was lost and couldn't be put back, in which
+ * case the caller closes fd and goes on polling cron.update.
+ */
+int
+ReadWatches(int fd, time_t t1, time_t t2)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t n;
+	char *ptr;
+	int lost = 0;
+	int gone = 0;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + n; ptr += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)ptr;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				printlogf(LOG_NOTICE, "inotify queue overflowed, rescanning\n");
+				lost = 1;
+			} else if ((ev->mask & WATCH_GONE) && ev->len == 0 &&
+					(ev->wd == CDirWd || ev->wd == SCDirWd || ev->wd == TSDirWd)) {
+				/* IN_IGNORED for a watch AddWatches dropped has an old wd */
+				if (!gone)
+					printlogf(LOG_NOTICE, "watched directory %s went away, rescanning\n",
+							(ev->wd == CDirWd) ? CDir : (ev->wd == SCDirWd) ? SCDir : TSDir);
+				lost = gone = 1;
+			} else if (ev->len == 0 || lost) {
+				continue;
+			} else if (ev->wd == CDirWd) {
+				WatchedFile(CDir, NULL, ev, t1, t2);
+			} else if (ev->wd == SCDirWd) {
+				WatchedFile(SCDir, "root", ev, t1, t2);
+			} else if (ev->wd == TSDirWd) {
+				WatchedStamp(ev);
+			}
+		}
+	}
+	if (gone && AddWatches(fd) < 0)
+		return(-1);
+	return(lost);
+}
+
+/*
+ * WatchedFile() - a file in a crontab directory was written, renamed or removed
+ */
+void
+WatchedFile(const char *dpath, const char *user_override, struct inotify_event *ev, time_t t1, time_t t2)
+{
+	const char *user = user_override ? user_override : ev->name;
+
+	if (DebugOpt)
+		printlogf(LOG_DEBUG, "inotify: %s/%s\n", dpath, ev->name);
+
+	if (strcmp(ev->name, CRONUPDATE) == 0) {
+		if (ev->mask & (IN_CLOSE_WRITE|IN_MOVED_TO))
+			CheckUpdates(dpath, user_override, t1, t2, 1);
+	} else if (strchr(ev->name, '.') != NULL) {
+		/* same as SynchronizeDir: temporaries like crontab's user.new */
+		;
+	} else if (ev->mask & (IN_MOVED_FROM|IN_DELETE)) {
+		/* SynchronizeFile finds nothing to read, and just deletes */
+		SynchronizeFile(dpath, ev->name, user);
+	} else if (!user_override && !getpwnam(ev->name)) {
+		printlogf(LOG_WARNING, "ignoring %s/%s (non-existent user)\n", dpath, ev->name);
+	} else {
+		SynchronizeFile(dpath, ev->name, user);
+		ReadTimestamps(user);
+	}
+}
+
+/*
+ * WatchedStamp() - a timestamp "user.job" was written, renamed or removed
+ *
+ * We see our own writes here too; CheckTimestamp knows them, and
+ * ReadTimestamp doesn't reread them.
+ */
+void
+WatchedStamp(struct inotify_event *ev)
+{
+	CronFile *file;
+	CronLine *line;
+	char user[SMALL_BUFFER];
+	char *job;
+
+	if (!(ev->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)) || strcmp(ev->name, STAMPFILE) == 0 ||
+			strncmp(ev->name, SNAPFILE, sizeof(SNAPFILE) - 1) == 0)
+		return;
+	if ((job = strchr(ev->name, '.')) == NULL || job - ev->name >= sizeof(user))
+		return;
+	memcpy(user, ev->name, job - ev->name);
+	user[job++ - ev->name] = 0;
+
+	for (file = FindUserFile(user, NULL); file; file = FindUserFile(user, file)) {
+		if ((line = FindJob(file, job)) != NULL && line->cl_Timestamp) {
+			if (DebugOpt)
+				printlogf(LOG_DEBUG, "inotify: %s\n", line->cl_Timestamp);
+			CheckTimestamp(line);
+			ReadTimestamp(file, line);
+		}
+	}
+}